@@ -0,0 +1,459 @@
+/* bench_dsm.c
+
+   Benchmark suite of the DSM as applications see it. A number of nodes
+   on this machine share a region through libdsm and run a set of
+   workloads over it, each taking its pages by faulting on them:
+
+   seqread	node 0 writes every page, the others read them in order
+   randread	... the others read them in random order
+   randwrite	every node writes random pages
+   readmostly	every node reads random pages and writes one in WRITE_PCT
+   prodcons	node 0 writes a batch of pages, the others read it, repeat
+   migratory	every node increments a counter under a lock
+   skewed	every node writes its own pages, the others read some, repeat
+
+   or instead replay an access trace, with as many nodes as it has.
+   For every workload and node a line of JSON gives the faults per
+   second, the percentiles of the time to serve a fault and the bytes the
+   node sent, so that runs of different releases can be compared.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "dsm.h"
+
+#define BASE_PORT 9500
+#define DEFAULT_NODES 2
+#define DEFAULT_PAGES 1024
+#define DEFAULT_OPS 2000
+#define BATCH 16		/* Pages per round of prodcons */
+#define WRITE_PCT 5		/* Writes per hundred accesses of readmostly */
+#define OWN_PAGES 16		/* Pages each node of skewed writes per round */
+#define READ_PCT 25		/* ... of which the others read this many */
+
+struct workload {
+	const char *name;
+	int (*run)(void);	/* Returns 0, or -1 if it read a wrong value */
+};
+
+static int nnodes = DEFAULT_NODES;
+static unsigned long npages = DEFAULT_PAGES;
+static unsigned long nops = DEFAULT_OPS;	/* Accesses per node */
+static unsigned long granule;
+static int transport = DSM_SOCKETS;
+static int lrc;
+static int no_migratory;
+static int fixed_homes;
+static int no_shm;
+static int one_lane;
+static char *only;		/* Comma-separated workloads to run */
+static char *record;		/* Record the nodes' traces to record.<node> */
+static char *faultlog;		/* Log their faults to faultlog.<node> */
+static struct trace trace;	/* Replayed instead, once loaded */
+static int timed;		/* ... keeping its think times */
+
+static int self;
+static char *base;
+static unsigned long gen;	/* What node 0 wrote last, see fill() */
+static unsigned int seed;
+
+static double
+now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile unsigned long *
+page(unsigned long i)
+{
+	return (volatile unsigned long *) (base + i * granule);
+}
+
+/* Node 0 writes the first word of every page, which takes the pages
+ * away from the other nodes.
+ */
+static void
+fill(void)
+{
+	gen += npages;
+	if (self == 0)
+		for (unsigned long i = 0; i < npages; i++)
+			*page(i) = gen + i;
+	dsm_barrier();
+}
+
+static int
+check(unsigned long i, unsigned long want)
+{
+	if (*page(i) == want)
+		return 0;
+	fprintf(stderr, "Node %d: page %lu holds %lu, not %lu\n", self, i,
+		*page(i), want);
+	return -1;
+}
+
+static int
+seq_read(void)
+{
+	if (self == 0)
+		return 0;
+	for (unsigned long i = 0; i < npages; i++)
+		if (check(i, gen + i) == -1)
+			return -1;
+	return 0;
+}
+
+static int
+rand_read(void)
+{
+	unsigned long p;
+
+	if (self == 0)
+		return 0;
+	for (unsigned long i = 0; i < nops; i++) {
+		p = rand_r(&seed) % npages;
+		if (check(p, gen + p) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* Every node writes a word of its own, so the first word stays what
+ * node 0 put there.
+ */
+static int
+rand_write(void)
+{
+	for (unsigned long i = 0; i < nops; i++)
+		page(rand_r(&seed) % npages)[self + 1] = i;
+	return 0;
+}
+
+static int
+read_mostly(void)
+{
+	unsigned long p;
+
+	for (unsigned long i = 0; i < nops; i++) {
+		p = rand_r(&seed) % npages;
+		if (rand_r(&seed) % 100 < WRITE_PCT)
+			page(p)[self + 1] = i;
+		else if (check(p, gen + p) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+prod_cons(void)
+{
+	unsigned long p;
+
+	for (unsigned long r = 0; r < (nops + BATCH - 1) / BATCH; r++) {
+		for (unsigned long k = 0; k < BATCH; k++) {
+			p = (r * BATCH + k) % npages;
+			if (self == 0)
+				*page(p) = gen + r;
+		}
+		dsm_barrier();
+		for (unsigned long k = 0; k < BATCH && self != 0; k++)
+			if (check((r * BATCH + k) % npages, gen + r) == -1)
+				return -1;
+		dsm_barrier();
+	}
+	return 0;
+}
+
+static int
+migratory(void)
+{
+	unsigned long start = *page(0);
+
+	dsm_barrier();
+	for (unsigned long i = 0; i < nops; i++) {
+		dsm_lock(0);
+		(*page(0))++;
+		page(0)[1] = self;
+		dsm_unlock(0);
+	}
+	dsm_barrier();
+	return check(0, start + nnodes * nops);
+}
+
+/* Each page is missed on mostly by the node that writes it, wherever
+ * its home was hashed to.
+ */
+static int
+skewed(void)
+{
+	unsigned long p;
+
+	for (unsigned long r = 0; r < (nops + OWN_PAGES - 1) / OWN_PAGES; r++) {
+		for (unsigned long k = 0; k < OWN_PAGES; k++)
+			page((k * nnodes + self) % npages)[self + 1] = r;
+		dsm_barrier();
+		for (unsigned long k = 0; k < OWN_PAGES * nnodes; k++) {
+			p = k % npages;
+			if (k % nnodes != (unsigned long) self &&
+			    rand_r(&seed) % 100 < READ_PCT &&
+			    check(p, gen + p) == -1)
+				return -1;
+		}
+		dsm_barrier();
+	}
+	return 0;
+}
+
+static int
+replay(void)
+{
+	trace_replay(&trace, base, self, timed);
+	return 0;
+}
+
+static const struct workload workloads[] = {
+	{ "seqread", seq_read },
+	{ "randread", rand_read },
+	{ "randwrite", rand_write },
+	{ "readmostly", read_mostly },
+	{ "prodcons", prod_cons },
+	{ "migratory", migratory },
+	{ "skewed", skewed },
+};
+
+static int
+selected(const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	if (only == NULL)
+		return 1;
+	for (p = only; p != NULL; p = strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+		if (strncmp(p, name, len) == 0 &&
+		    (p[len] == ',' || p[len] == '\0'))
+			return 1;
+	}
+	return 0;
+}
+
+/* Run w on every node and print what it took on this one to out.
+ */
+static void
+measure(const struct workload *w, int out)
+{
+	static struct lat_counts before, after;
+	struct msi_stats st0, st1;
+	int shm = nnodes > 1 && shm_link(!self) != NULL;
+	double t;
+
+	lat_counts(LAT_TOTAL, &before);
+	msi_stats(&st0);
+	t = now_s();
+	if (w->run() == -1)
+		exit(EXIT_FAILURE);
+	t = now_s() - t;
+	lat_counts(LAT_TOTAL, &after);
+	lat_counts_sub(&after, &before);
+
+	/* Count what we sent serving the others until all are done */
+	dsm_barrier();
+	msi_stats(&st1);
+
+	for (int n = 0; n < nnodes; n++) {
+		if (n == self)
+			dprintf(out, "{\"workload\":\"%s\",\"node\":%d,"
+				"\"nodes\":%d,\"transport\":\"%s\","
+				"\"mode\":\"%s\",\"migratory\":%s,"
+				"\"homes\":\"%s\",\"shm\":%s,"
+				"\"lanes\":%s,"
+				"\"granule\":%lu,"
+				"\"secs\":%.6f,\"faults\":%lu,"
+				"\"faults_per_sec\":%.1f,"
+				"\"p50_us\":%.1f,\"p99_us\":%.1f,"
+				"\"p999_us\":%.1f,\"wire_bytes\":%lu,"
+				"\"msgs\":%lu,\"home_moves\":%lu}\n",
+				w->name, self,
+				nnodes, reactor_transport_name(transport),
+				lrc ? "lrc" : "msi",
+				no_migratory ? "false" : "true",
+				fixed_homes ? "fixed" : "moving",
+				shm ? "true" : "false",
+				shm || one_lane ? "false" : "true",
+				granule, t,
+				after.n, after.n / t,
+				lat_quantile(&after, 0.5) / 1e3,
+				lat_quantile(&after, 0.99) / 1e3,
+				lat_quantile(&after, 0.999) / 1e3,
+				st1.wire - st0.wire,
+				st1.msgs - st0.msgs,
+				st1.home_moves - st0.home_moves);
+		dsm_barrier();
+	}
+}
+
+static void
+run_node(void)
+{
+	static const struct workload replayed = { "replay", replay };
+	struct dsm_node nodes[MAX_NODES];
+	struct dsm_config cfg;
+	int out;
+
+	for (int i = 0; i < nnodes; i++) {
+		strcpy(nodes[i].host, "127.0.0.1");
+		snprintf(nodes[i].port, sizeof(nodes[i].port), "%d",
+			 BASE_PORT + i);
+	}
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.self = self;
+	cfg.nnodes = nnodes;
+	cfg.nodes = nodes;
+	cfg.transport = transport;
+	cfg.lrc = lrc;
+	cfg.no_migratory = no_migratory;
+	cfg.fixed_homes = fixed_homes;
+	cfg.no_shm = no_shm;
+	cfg.one_lane = one_lane;
+	cfg.record = record;
+	cfg.faultlog = faultlog;
+
+	/* cluster_connect() talks about its progress; keep only ours */
+	out = dup(STDOUT_FILENO);
+	if (out == -1)
+		errExit("dup");
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		errExit("freopen");
+	dsm_init(&cfg);
+	base = dsm_region_create(npages * granule, granule, DSM_ANON);
+
+	if (trace.pages > 0) {
+		dsm_barrier();
+		measure(&replayed, out);
+	} else {
+		for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]);
+		     i++) {
+			if (!selected(workloads[i].name))
+				continue;
+			seed = self * 7919 + i;
+			fill();
+			measure(&workloads[i], out);
+		}
+	}
+
+	dsm_shutdown();
+	_exit(EXIT_SUCCESS);
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-l] [-H] [-M] [-N] [-S] [-g granule] "
+		"[-n nodes] [-p pages] [-o ops]\n"
+		"\t[-t sockets|uring] [-w workload,...] [-F fault-log] "
+		"[-R record-file] [-T trace [-r]]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, status, failed = 0;
+	pid_t pid[MAX_NODES];
+
+	granule = sysconf(_SC_PAGE_SIZE);
+	while ((c = getopt(argc, argv, "lHMNSrg:n:o:p:t:w:F:R:T:")) != -1) {
+		switch (c) {
+		case 'l':
+			lrc = 1;
+			break;
+		case 'H':
+			fixed_homes = 1;
+			break;
+		case 'M':
+			no_migratory = 1;
+			break;
+		case 'N':
+			no_shm = 1;
+			break;
+		case 'S':
+			one_lane = 1;
+			break;
+		case 'g':
+			granule = region_parse_size(optarg);
+			break;
+		case 'n':
+			nnodes = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			nops = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			npages = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			transport = reactor_transport(optarg);
+			if (transport == -1)
+				usage(argv[0]);
+			break;
+		case 'w':
+			only = optarg;
+			break;
+		case 'F':
+			faultlog = optarg;
+			break;
+		case 'R':
+			record = optarg;
+			break;
+		case 'T':
+			trace_load(optarg, &trace);
+			break;
+		case 'r':
+			timed = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (trace.pages > 0) {
+		/* The trace decides the cluster and the region */
+		if (trace.nnodes > nnodes)
+			nnodes = trace.nnodes;
+		npages = trace.pages;
+		granule = trace.granule;
+	}
+	if (optind != argc || nnodes < 2 || nnodes > MAX_NODES ||
+	    npages == 0 || nops == 0 || (timed && trace.pages == 0))
+		usage(argv[0]);
+
+	for (int i = 0; i < nnodes; i++) {
+		pid[i] = fork();
+		if (pid[i] == -1)
+			errExit("fork");
+		if (pid[i] == 0) {
+			self = i;
+			run_node();
+		}
+	}
+	for (int i = 0; i < nnodes; i++) {
+		if (waitpid(pid[i], &status, 0) == -1)
+			errExit("waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
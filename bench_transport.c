@@ -0,0 +1,377 @@
+/* bench_transport.c
+
+   Loopback benchmark of the DSM transports. Two nodes on this machine
+   pass a region back and forth, over TCP or through the shared memory
+   link the nodes set up otherwise: in every round node 0 writes
+   each page, which invalidates node 1's copies, and node 1 then reads
+   each page back. The time to obtain a page is reported per node and
+   transport, along with the page data each node sent. Under lazy release
+   consistency node 0 releases after writing and node 1 acquires before
+   reading, and both count as part of obtaining the pages. With -k both
+   nodes then take turns incrementing a counter under a DSM lock, or with
+   -b meet at a DSM barrier while the pages move at the same time.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "dsm.h"
+
+#define BASE_PORT 9300
+#define DEFAULT_PAGES 1024
+#define DEFAULT_ROUNDS 5
+#define SHM (DSM_URING + 1)	/* Pseudo transport: the shared memory link */
+
+static unsigned long npages = DEFAULT_PAGES;
+static int rounds = DEFAULT_ROUNDS;
+static unsigned long granule;
+static unsigned long wbytes;	/* Bytes written per page, 0 for all */
+static int diff;
+static int compress;
+static int lrc;
+static unsigned long nlocks;	/* Lock rounds per node */
+static int bulk;		/* ... or barriers while the pages move */
+static int one_lane;		/* See msi_set_lanes() */
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Wait until the other node gets here too.
+ */
+static void
+barrier(int wfd, int rfd)
+{
+	char c = 0;
+
+	if (write(wfd, &c, 1) != 1 || read(rfd, &c, 1) != 1)
+		errExit("barrier");
+}
+
+/* Pass the region back and forth, and return the microseconds this node
+ * spent obtaining pages.
+ */
+static double
+page_rounds(int self, char *base, int wfd, int rfd)
+{
+	double t, total = 0;
+	char *p;
+
+	for (int r = 0; r < rounds; r++) {
+		if (self == 0) {
+			t = now_us();
+			for (unsigned long i = 0; i < npages; i++) {
+				msi_acquire(i, 1);
+				memset(base + i * granule, 'a' + r, wbytes);
+			}
+			dsm_release();
+			total += now_us() - t;
+		}
+		barrier(wfd, rfd);
+
+		if (self == 1) {
+			t = now_us();
+			dsm_acquire();
+			for (unsigned long i = 0; i < npages; i++) {
+				msi_acquire(i, 0);
+				p = base + i * granule;
+				if (p[0] != 'a' + r || p[wbytes - 1] != 'a' + r) {
+					fprintf(stderr, "Page %lu is stale\n", i);
+					exit(EXIT_FAILURE);
+				}
+			}
+			total += now_us() - t;
+		}
+		barrier(wfd, rfd);
+	}
+	return total;
+}
+
+struct bulk {
+	int self;
+	char *base;
+	int wfd, rfd;
+	double total;
+};
+
+static void *
+bulk_thread(void *arg)
+{
+	struct bulk *b = arg;
+
+	b->total = page_rounds(b->self, b->base, b->wfd, b->rfd);
+	return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Both nodes increment the first word of the region under lock 0, and
+ * lat[i] receives the microseconds round i took. The barriers make sure
+ * both start from the same value and see the final one. While the pages
+ * move in the background each round is a barrier instead: a round trip
+ * of messages without page contents.
+ */
+static void
+lock_rounds(char *base, double *lat)
+{
+	volatile unsigned long *counter = (volatile unsigned long *) base;
+	unsigned long start = 0;
+	double t;
+
+	dsm_barrier();
+	if (!bulk) {
+		msi_acquire(0, 0);
+		start = *counter;
+	}
+	dsm_barrier();
+	for (unsigned long i = 0; i < nlocks; i++) {
+		t = now_us();
+		if (bulk) {
+			dsm_barrier();
+		} else {
+			dsm_lock(0);
+			msi_acquire(0, 1);
+			(*counter)++;
+			dsm_unlock(0);
+		}
+		lat[i] = now_us() - t;
+	}
+	dsm_barrier();
+	if (!bulk) {
+		msi_acquire(0, 0);
+		if (*counter != start + 2 * nlocks) {
+			fprintf(stderr, "Counter is %lu, not %lu\n", *counter,
+				start + 2 * nlocks);
+			exit(EXIT_FAILURE);
+		}
+	}
+	qsort(lat, nlocks, sizeof(*lat), cmp_double);
+}
+
+static void
+run_node(int self, int transport, int wfd, int rfd)
+{
+	struct dsm_node nodes[2];
+	struct dsm_region rgn;
+	int peer[2], out, s;
+	struct msi_stats st;
+	struct bulk b;
+	pthread_t thr;
+	double total = 0, lock_us = 0, *lat;
+
+	for (int i = 0; i < 2; i++) {
+		strcpy(nodes[i].host, "127.0.0.1");
+		snprintf(nodes[i].port, sizeof(nodes[i].port), "%d",
+			 BASE_PORT + 2 * transport + i);
+	}
+	shm_set(transport == SHM);
+	if (transport == SHM)
+		transport = DSM_SOCKETS;
+
+	memset(&rgn, 0, sizeof(rgn));
+	rgn.len = npages * granule;
+	rgn.granule = granule;
+	rgn.backing = DSM_ANON;
+	region_create(&rgn, NULL);
+
+	/* cluster_connect() talks about its progress; keep only ours */
+	out = dup(STDOUT_FILENO);
+	if (out == -1)
+		errExit("dup");
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		errExit("freopen");
+	cluster_connect(self, 2, nodes, peer, !one_lane);
+	msi_set_diff(diff);
+	msi_set_compress(compress);
+	msi_set_lrc(lrc);
+	msi_set_lanes(!one_lane);
+	msi_init(self, 2, &rgn, transport);
+	msi_add_peer(1 - self, peer[1 - self]);
+
+	lat = malloc((nlocks ? nlocks : 1) * sizeof(*lat));
+	if (lat == NULL)
+		errExit("malloc");
+	if (bulk) {
+		b.self = self;
+		b.base = rgn.base;
+		b.wfd = wfd;
+		b.rfd = rfd;
+		s = pthread_create(&thr, NULL, bulk_thread, &b);
+		if (s != 0) {
+			errno = s;
+			errExit("pthread_create");
+		}
+		lock_rounds(rgn.base, lat);
+		s = pthread_join(thr, NULL);
+		if (s != 0) {
+			errno = s;
+			errExit("pthread_join");
+		}
+		total = b.total;
+	} else {
+		total = page_rounds(self, rgn.base, wfd, rfd);
+		if (nlocks > 0)
+			lock_rounds(rgn.base, lat);
+	}
+	for (unsigned long i = 0; i < nlocks; i++)
+		lock_us += lat[i] / nlocks;
+
+	/* Take turns printing */
+	if (self == 1)
+		barrier(wfd, rfd);
+	msi_stats(&st);
+	dprintf(out, "%-8s %-6s %lu x %lu bytes: %8.1f us/page, "
+		"sent %lu pages %lu diffs %lu zero %lu KB %lu msgs\n",
+		shm_link(1 - self) ? "shm" : reactor_transport_name(transport),
+		self ? "read" : "write",
+		npages * rounds, granule, total / (npages * rounds),
+		st.full, st.diffs, st.zeros, st.bytes >> 10, st.msgs);
+	if (nlocks > 0)
+		dprintf(out, "%17s %lu %s rounds: %.1f us/round, p50 %.1f "
+			"p99 %.1f max %.1f\n", "", nlocks,
+			bulk ? "barrier" : "lock", lock_us,
+			lat[nlocks / 2], lat[nlocks * 99 / 100], lat[nlocks - 1]);
+	if (st.flushes > 0)
+		dprintf(out, "%17s flushed %lu pages, %lu KB\n", "",
+			st.flushes, st.flush_bytes >> 10);
+	if (st.lz_tried > 0)
+		dprintf(out, "%17s compressed %lu of %lu pages %.1f:1, "
+			"%.0f ns/page\n", "", st.lz_sent, st.lz_tried,
+			st.lz_out ? (double) st.lz_in / st.lz_out : 0.0,
+			(double) st.lz_ns / st.lz_tried);
+	if (st.unlz_pages > 0)
+		dprintf(out, "%17s decompressed %lu pages, %.0f ns/page\n", "",
+			st.unlz_pages, (double) st.unlz_ns / st.unlz_pages);
+	if (self == 0)
+		barrier(wfd, rfd);
+
+	/* Whichever node leaves first closes the connection on the other */
+	if (freopen("/dev/null", "w", stderr) == NULL)
+		errExit("freopen");
+	barrier(wfd, rfd);
+	_exit(EXIT_SUCCESS);
+}
+
+static void
+run(int transport)
+{
+	int a[2], b[2], status;
+	pid_t pid[2];
+
+	if (pipe(a) == -1 || pipe(b) == -1)
+		errExit("pipe");
+
+	for (int self = 0; self < 2; self++) {
+		pid[self] = fork();
+		if (pid[self] == -1)
+			errExit("fork");
+		if (pid[self] == 0) {
+			if (self == 0)
+				run_node(0, transport, a[1], b[0]);
+			else
+				run_node(1, transport, b[1], a[0]);
+		}
+	}
+	for (int i = 0; i < 2; i++)
+		if (waitpid(pid[i], &status, 0) == -1)
+			errExit("waitpid");
+
+	close(a[0]);
+	close(a[1]);
+	close(b[0]);
+	close(b[1]);
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b] [-c] [-d] [-l] [-S] [-g granule] [-n pages] "
+		"[-r rounds]\n\t[-t sockets|uring|shm] [-w bytes] "
+		"[-k lock-rounds]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int transport = -1;
+	int c;
+
+	granule = sysconf(_SC_PAGE_SIZE);
+	while ((c = getopt(argc, argv, "bcdlSg:k:n:r:t:w:")) != -1) {
+		switch (c) {
+		case 'b':
+			bulk = 1;
+			break;
+		case 'c':
+			compress = 1;
+			break;
+		case 'd':
+			diff = 1;
+			break;
+		case 'l':
+			lrc = 1;
+			break;
+		case 'S':
+			one_lane = 1;
+			break;
+		case 'g':
+			granule = region_parse_size(optarg);
+			break;
+		case 'k':
+			nlocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			npages = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			transport = strcmp(optarg, "shm") == 0 ? SHM :
+				    reactor_transport(optarg);
+			if (transport == -1)
+				usage(argv[0]);
+			break;
+		case 'w':
+			wbytes = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (wbytes == 0)
+		wbytes = granule;
+	if (optind != argc || npages == 0 || rounds <= 0 || wbytes > granule)
+		usage(argv[0]);
+
+	if (transport == -1) {
+		run(DSM_SOCKETS);
+		run(DSM_URING);
+		run(SHM);
+	} else {
+		run(transport);
+	}
+	exit(EXIT_SUCCESS);
+}
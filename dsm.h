@@ -0,0 +1,627 @@
+/* dsm.h
+
+   Interface of the distributed shared memory runtime used by uffd_part3
+   and packaged as libdsm. Programs embedding the library need the
+   dsm_* calls only; the rest is the runtime's own plumbing.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#ifndef DSM_H
+#define DSM_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define MAX_NODES 64		/* Nodes are tracked in one unsigned long */
+
+#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE);	\
+	} while (0)
+
+/* Memory behind the shared region.
+ */
+enum dsm_backing {
+	DSM_ANON,		/* Private anonymous base pages */
+	DSM_HUGETLB,		/* Private anonymous 2 MB huge pages */
+	DSM_MEMFD,		/* Shared 2 MB huge pages of a hugetlb memfd */
+};
+
+/* The shared region. Coherence is kept in units of granule bytes; the
+ * MSI code calls such a unit a page.
+ */
+struct dsm_region {
+	char *base;
+	unsigned long len;
+	unsigned long granule;
+	int backing;
+	int fd;			/* memfd for DSM_MEMFD, otherwise -1 */
+	long uffd;		/* userfaultfd the region is registered with */
+};
+
+/* Map a region of r->len bytes with r->backing at hint, or anywhere if
+ * it is NULL, and register it with a new userfaultfd. A region that
+ * cannot go at hint is fatal. r->granule is fixed up for huge pages and
+ * r->len rounded up to a whole number of granules.
+ */
+void region_create(struct dsm_region *r, char *hint);
+void region_drop(struct dsm_region *r, unsigned long off, unsigned long len);
+int region_backing(const char *name);
+const char *region_backing_name(int backing);
+unsigned long region_parse_size(const char *s);
+
+/* A member of the cluster. Its ID is its index in the membership list.
+ */
+struct dsm_node {
+	char host[256];
+	char port[16];
+};
+
+/* Read the membership list at path, one "host port" line per node, into
+ * nodes[MAX_NODES] and return the number of nodes.
+ */
+int cluster_load(const char *path, struct dsm_node *nodes);
+
+/* Connect node self to every other member. fd[i] receives the socket
+ * leading to node i, and fd[self] is -1. With with_lanes set, each pair
+ * of nodes also opens DSM_DATA_LANES more connections, found with
+ * cluster_lane(), for page contents to take instead; every node must
+ * agree on it. Nodes on the same host also get a shm_link() to each
+ * other, and have no use for the lanes between them, which
+ * cluster_close_lanes() gives back.
+ */
+#define DSM_DATA_LANES 2
+
+void cluster_connect(int self, int nnodes, struct dsm_node *nodes, int *fd,
+		     int with_lanes);
+int cluster_lane(int node, int lane);	/* -1 if there is none */
+void cluster_close_lanes(int node);
+
+/* How nodes exchange messages and the reactor waits for events.
+ */
+enum dsm_transport {
+	DSM_SOCKETS,		/* epoll, recv() and a writev() thread per peer */
+	DSM_URING,		/* io_uring for all of it */
+};
+
+/* Called on the reactor thread when fd becomes readable. It must not
+ * block, and has to read everything there is: with io_uring it is not
+ * called again for data that was already there.
+ */
+typedef void (*reactor_fn)(int fd, void *arg);
+
+/* Start the reactor thread for transport; later calls do nothing. */
+void reactor_init(int transport);
+
+/* Call fn(fd, arg) whenever fd is readable. */
+void reactor_add(int fd, reactor_fn fn, void *arg);
+int reactor_transport(const char *name);
+const char *reactor_transport_name(int transport);
+
+/* The io_uring transport. Received bytes are passed to a uring_recv_fn,
+ * with len 0 once the peer has closed the connection, and sent chains
+ * are reported to a uring_done_fn, both on the thread that reaps
+ * completions.
+ */
+struct iovec;
+typedef void (*uring_recv_fn)(void *arg, const char *data, size_t len);
+typedef void (*uring_done_fn)(void *arg);
+
+void uring_init(void);
+void uring_poll(int fd, reactor_fn fn, void *arg);
+void uring_recv(int fd, uring_recv_fn fn, void *arg);
+
+/* Send the cnt buffers of iov on fd, in order, as one chain of linked
+ * sends. The buffers must stay valid until done(arg) is called; the
+ * caller must not start another chain on fd before that.
+ */
+void uring_send(int fd, struct iovec *iov, int cnt, uring_done_fn done,
+		void *arg);
+
+/* Shared memory links between nodes on the same host, set up by
+ * shm_negotiate() over the connected sockets unless shm_set(0) was
+ * called first. A link carries records of up to SHM_MAX_RECORD bytes
+ * each way. The writing calls are for one thread at a time, shm_next(),
+ * shm_done() and shm_sleep() for one other thread; the reader
+ * polls shm_fd() for records once shm_sleep() returned 1.
+ */
+#define SHM_RING_BYTES (8UL << 20)	/* Each way, a power of 2 */
+#define SHM_MAX_RECORD (SHM_RING_BYTES / 2)
+
+struct shm_link;
+
+void shm_set(int on);
+void shm_negotiate(int self, int nnodes, int *fd);
+struct shm_link *shm_link(int node);	/* NULL if the node is remote */
+int shm_fd(struct shm_link *l);
+
+/* Queue a record made of hdr and data, waiting for room if need be, or
+ * only if there is room, returning whether it was queued. shm_push()
+ * lets the other node see what was queued.
+ */
+void shm_put(struct shm_link *l, const void *hdr, size_t hlen,
+	     const void *data, size_t dlen);
+int shm_try_put(struct shm_link *l, const void *hdr, size_t hlen,
+		const void *data, size_t dlen);
+void shm_push(struct shm_link *l);
+
+/* The next record in place, or NULL, and done with it.
+ */
+const char *shm_next(struct shm_link *l, size_t *len);
+void shm_done(struct shm_link *l, size_t len);
+int shm_sleep(struct shm_link *l);
+
+/* State of a page, both in a node's local copy and in the directory.
+ */
+enum msi_state {
+	MSI_INVALID,
+	MSI_SHARED,
+	MSI_MODIFIED,
+};
+
+/* Result of msi_fetch().
+ */
+enum msi_fetch {
+	MSI_PRESENT,		/* Local copy already valid, nothing to do */
+	MSI_FETCHED,		/* Contents were copied into the buffer */
+	MSI_GRANTED,		/* Upgrade of a Shared copy, no data */
+	MSI_ZERO,		/* Contents are all zero, buffer untouched */
+	MSI_PENDING,		/* Request sent, see msi_fetch_begin() */
+	MSI_BUSY,		/* Another request for the page is outstanding */
+};
+
+/* Wakes a caller with several requests outstanding whenever any of them
+ * is answered.
+ */
+struct msi_notify {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long count;	/* Replies delivered so far */
+};
+
+/* A local request waiting for its reply. The caller fills in buf and
+ * notify, which may be NULL.
+ */
+struct msi_wait {
+	char *buf;		/* Receives the page contents */
+	struct msi_notify *notify;
+	int done;
+	int fetched;
+	int zero;
+};
+
+/* Set up the coherence engine for region r. self is this node's ID among
+ * nnodes nodes, which talk over transport.
+ */
+void msi_init(int self, int nnodes, struct dsm_region *r, int transport);
+
+/* Keep a twin of every page this node writes and, when the page moves on,
+ * send peers that hold an older copy only the bytes that changed. Call
+ * before msi_init().
+ */
+void msi_set_diff(int on);
+
+/* Compress whole pages sent to peers when that saves at least an eighth
+ * of the page, and send them raw otherwise. Call before msi_init().
+ */
+void msi_set_compress(int on);
+
+/* Detect pages that migrate from node to node, each reading and then
+ * writing them, and move them whole on a read miss. On by default; it
+ * does nothing under lazy release consistency. Call before msi_init().
+ */
+void msi_set_migratory(int on);
+
+/* Move the home of a page to a node that misses on it much more often
+ * than the home does. On by default; it does nothing under lazy release
+ * consistency. Call before msi_init().
+ */
+void msi_set_home_moves(int on);
+
+/* Send page contents to each peer over the data lane of their page
+ * number, so that they do not hold up the other messages on the main
+ * connection. On by default; off, everything takes the main connection.
+ * Each node decides for the messages it sends.
+ */
+void msi_set_lanes(int on);
+
+/* Keep pages coherent only at synchronization points: writes become
+ * visible to another node once the writer calls dsm_release() and the
+ * other node then calls dsm_acquire(). Node 0 sets the mode before
+ * msi_init() and msi_send_region() passes it on.
+ */
+void msi_set_lrc(int on);
+
+/* Wait for every node at a barrier after which peers closing their
+ * connections is no error. Every node calls it before any of them leaves.
+ */
+void msi_shutdown(void);
+
+/* Messages and page contents this node has sent, what compression did
+ * for them, and what the directory on this node made of migratory pages
+ * and of homes moving.
+ */
+struct msi_stats {
+	unsigned long full;	/* Whole pages */
+	unsigned long diffs;
+	unsigned long zeros;	/* All-zero pages, sent as a header only */
+	unsigned long bytes;	/* Payload of all of them */
+	unsigned long lz_tried;	/* Pages offered to the compressor */
+	unsigned long lz_sent;	/* ... sent compressed */
+	unsigned long lz_in;	/* Bytes of the pages sent compressed */
+	unsigned long lz_out;	/* ... after compression */
+	unsigned long lz_ns;	/* Time spent compressing */
+	unsigned long unlz_pages;	/* Pages received compressed */
+	unsigned long unlz_ns;	/* Time spent decompressing them */
+	unsigned long msgs;	/* Messages of any kind */
+	unsigned long flushes;	/* LRC: pages sent home at a release */
+	unsigned long flush_bytes;	/* ... and their payload */
+	unsigned long wire;	/* Bytes sent to other nodes, with headers */
+	unsigned long mig_found;	/* Home: pages found migratory */
+	unsigned long mig_grants;	/* ... read misses given the page whole */
+	unsigned long mig_reverted;	/* ... pages back to plain MSI */
+	unsigned long home_moves;	/* Homes handed to another node */
+	unsigned long home_fwds;	/* Messages passed on to a moved home */
+};
+
+void msi_stats(struct msi_stats *st);
+
+/* Describe region r to the node at the other end of socket fd, and read
+ * such a description into r. Both happen before msi_init(); the receiver
+ * returns the address to map its copy at.
+ */
+void msi_send_region(int fd, struct dsm_region *r);
+char *msi_recv_region(int fd, struct dsm_region *r);
+
+/* Attach the connected socket fd that leads to node and start serving the
+ * messages it delivers.
+ */
+void msi_add_peer(int node, int fd);
+
+/* Obtain read or write permission on a page. On MSI_FETCHED the page
+ * contents are in buf and the caller must install them, on MSI_ZERO it
+ * must install a zero page. Unless the result is MSI_PRESENT the caller
+ * must then call msi_complete().
+ */
+int msi_fetch(unsigned long pgno, int write, char *buf);
+void msi_complete(unsigned long pgno, int write);
+
+/* msi_fetch() in two halves, so that requests for several pages can be
+ * outstanding at once. msi_fetch_begin() returns MSI_PRESENT, MSI_PENDING
+ * once the request is sent, or MSI_BUSY without sending anything if this
+ * node already waits for the page. For a pending request,
+ * msi_fetch_done() tells whether the reply is in and msi_fetch_end()
+ * waits for it and returns MSI_FETCHED, MSI_ZERO or MSI_GRANTED.
+ */
+int msi_fetch_begin(unsigned long pgno, int write, struct msi_wait *w);
+int msi_fetch_done(unsigned long pgno, struct msi_wait *w);
+int msi_fetch_end(unsigned long pgno, struct msi_wait *w);
+
+/* msi_fetch() + install + msi_complete() for callers outside the fault
+ * handlers.
+ */
+void msi_acquire(unsigned long pgno, int write);
+
+int msi_state(unsigned long pgno);
+
+/* Under lazy release consistency, publish the writes this node made since
+ * its last release, and pick up those other nodes published before this
+ * acquire. Both do nothing in the default MSI mode.
+ */
+void dsm_release(void);
+void dsm_acquire(void);
+
+/* Locks shared by all nodes, numbered from 0 to DSM_LOCKS - 1, and a
+ * barrier for all of them. Under lazy release consistency taking a lock
+ * is an acquire and dropping it a release, and a barrier is both; the
+ * write notices the next holder needs travel with the lock.
+ */
+#define DSM_LOCKS 256
+
+#define DSM_ALLOC_LOCK (DSM_LOCKS - 1)	/* Taken by dsm_malloc() */
+
+void dsm_lock(unsigned int lock);
+void dsm_unlock(unsigned int lock);
+void dsm_barrier(void);
+
+/* How this node joins the cluster. Zero fields take the defaults.
+ */
+struct dsm_config {
+	int self;		/* This node's ID */
+	int nnodes;
+	struct dsm_node *nodes;	/* Membership list, nnodes entries */
+	int transport;		/* DSM_SOCKETS or DSM_URING */
+	int no_shm;		/* Stay on TCP with nodes on this host */
+	int handlers;		/* Fault handler threads */
+	int prefetch;		/* Prefetch window in granules, -1 for none */
+	int diff;		/* See msi_set_diff() */
+	int compress;		/* See msi_set_compress() */
+	int no_migratory;	/* See msi_set_migratory() */
+	int fixed_homes;	/* See msi_set_home_moves() */
+	int one_lane;		/* See msi_set_lanes() */
+	int lrc;		/* See msi_set_lrc(); node 0's setting counts */
+	const char *profile;	/* prof_write() to profile.<self> at the end */
+	int trace;		/* See fault_set_trace() */
+	const char *stats;	/* lat_export() destination, or NULL */
+	int stats_ms;		/* ... and period */
+	const char *record;	/* trace_write() to record.<self> at the end */
+	const char *faultlog;	/* flog_open() faultlog.<self> */
+};
+
+/* Connect to the other members. Every node calls it once.
+ */
+void dsm_init(const struct dsm_config *cfg);
+
+/* Create the shared region and start serving it; every node calls it,
+ * and all of them get the region node 0 describes with len bytes in
+ * granules of granule bytes (0 for the page size) backed by backing. The
+ * runtime keeps one region.
+ */
+char *dsm_region_create(unsigned long len, unsigned long granule,
+			int backing);
+
+/* Allocate from the region, or NULL if it is full. Objects are aligned
+ * to cache lines, and those of different nodes never share a granule.
+ * Any node may free any object.
+ */
+void *dsm_malloc(size_t size);
+void dsm_free(void *ptr);
+
+/* Leave the cluster; every node calls it and waits for the others. The
+ * region must not be touched afterwards.
+ */
+void dsm_shutdown(void);
+
+/* Set up dsm_malloc() over region r for node self.
+ */
+void alloc_init(struct dsm_region *r, int self);
+
+/* Encode into out the changes from twin to cur, both len bytes. Returns
+ * the size of the diff, or -1 if it would be larger than max.
+ */
+ssize_t diff_encode(const char *twin, const char *cur, size_t len, char *out,
+		    size_t max);
+
+/* Apply a diff of dlen bytes to the len bytes at page; -1 if malformed.
+ */
+int diff_apply(char *page, size_t len, const char *diff, size_t dlen);
+
+int page_is_zero(const char *page, size_t len);
+
+/* Compress len bytes at src into dst. Returns the compressed size, or -1
+ * if it would be larger than max.
+ */
+ssize_t lz_compress(const char *src, size_t len, char *dst, size_t max);
+
+/* Decompress slen bytes at src into at most max bytes at dst. Returns
+ * the size, or -1 if the input is malformed or too large.
+ */
+ssize_t lz_decompress(const char *src, size_t slen, char *dst, size_t max);
+
+#define DEFAULT_HANDLERS 4	/* Fault handler threads when none are given */
+#define DEFAULT_PREFETCH 16	/* Largest prefetch window, in granules */
+#define MAX_PREFETCH 64
+
+/* Start a pool of n threads that resolve the faults of region r, which
+ * the coherence engine serves, fetching up to window granules ahead.
+ */
+void fault_start(struct dsm_region *r, int n, int window);
+
+/* Print every fault as it is taken. Off by default, as printing holds
+ * up the handlers.
+ */
+void fault_set_trace(int on);
+
+/* Phases of serving a fault, each with its own latency histogram.
+ */
+enum lat_phase {
+	LAT_READ,		/* From read() of the userfaultfd to a handler */
+	LAT_LOOKUP,		/* Local state, directory and sending the request */
+	LAT_NETWORK,		/* Waiting for the reply */
+	LAT_COPY,		/* UFFDIO_COPY, ZEROPAGE or WRITEPROTECT */
+	LAT_TOTAL,		/* From read() to waking the faulting thread */
+	LAT_PHASES,
+};
+
+#define LAT_EXPORT_MS 1000	/* Default period of lat_export() */
+
+unsigned long lat_now(void);	/* Monotonic nanoseconds */
+
+/* Keep histograms for handlers 0 to nhandlers - 1, and add ns to one.
+ * Each handler records into its own, without locking.
+ */
+void lat_init(int nhandlers);
+void lat_record(int handler, int phase, unsigned long ns);
+
+/* Buckets are exact below 2^LAT_SUB_BITS ns; above, every power of two
+ * is cut into 2^LAT_SUB_BITS of them, up to 2^LAT_MAX_BITS ns.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_MAX_BITS 44
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+/* What one phase's histograms of all handlers hold at some point. The
+ * difference of two such snapshots covers what happened in between.
+ */
+struct lat_counts {
+	unsigned long n;
+	unsigned long sum;	/* Nanoseconds */
+	unsigned long count[LAT_BUCKETS];
+};
+
+void lat_counts(int phase, struct lat_counts *c);
+void lat_counts_sub(struct lat_counts *c, const struct lat_counts *before);
+
+/* Nanoseconds below which a fraction q of the values in c lie.
+ */
+unsigned long lat_quantile(const struct lat_counts *c, double q);
+
+/* Write the percentiles of every phase over all handlers to f, or every
+ * period_ms to dest: a file that is replaced each time, or a stream
+ * socket that is listening at path if dest is "unix:path".
+ */
+void lat_write(FILE *f);
+void lat_export(const char *dest, int period_ms);
+
+/* Prefetch up to window granules ahead of each sequential or strided
+ * stream of faults in a region of npages granules; 0 turns it off.
+ */
+void prefetch_init(int window, unsigned long npages);
+
+/* Record that thread tid faulted on granule pgno and return in out, which
+ * has room for the window, the granules to fetch ahead of it.
+ */
+int prefetch_fault(pid_t tid, unsigned long pgno, int write,
+		   unsigned long *out);
+void prefetch_stats(unsigned long *issued, unsigned long *used);
+
+/* Fault log: every fault the handlers serve, as a fixed-size event in a
+ * ring per handler of a file mapped shared, so that the events reach
+ * the file without a system call and survive a crash. Each ring keeps
+ * the last FLOG_EVENTS events of its handler; flog_report decodes the
+ * file.
+ */
+#define FLOG_MAGIC "DSMFLOG"
+#define FLOG_VERSION 1
+#define FLOG_EVENTS 65536	/* Events a ring keeps, a power of two */
+
+enum flog_flags {
+	FLOG_WRITE = 1,		/* A write fault */
+	FLOG_WP = 2,		/* ... on a write-protected copy */
+};
+
+struct flog_event {
+	uint64_t addr;		/* Faulting address */
+	uint64_t t;		/* lat_now() when the fault was read */
+	uint32_t latency;	/* Nanoseconds until the thread was woken */
+	uint32_t tid;		/* Faulting thread */
+	uint32_t flags;
+	uint32_t pad;
+};
+
+struct flog_header {
+	char magic[8];		/* FLOG_MAGIC */
+	uint32_t version;
+	uint32_t node;
+	uint32_t rings;		/* One per handler */
+	uint32_t events;	/* FLOG_EVENTS */
+	uint64_t base;		/* The region */
+	uint64_t len;
+	uint64_t granule;
+	uint64_t mono_ns;	/* lat_now() when the log was opened */
+	uint64_t real_ns;	/* ... and the time of day then */
+};
+
+/* A ring follows the header for every handler. Its writer bumps head
+ * after filling in the event at head % events.
+ */
+struct flog_ring {
+	uint64_t head;		/* Events ever written */
+	uint64_t pad[7];	/* Rings start on cache lines of their own */
+	struct flog_event ev[];
+};
+
+#define FLOG_RING_SIZE(events) \
+	(sizeof(struct flog_ring) + (events) * sizeof(struct flog_event))
+
+/* Log the faults of the nhandlers handlers of region r to a new file at
+ * path. Call it before fault_start().
+ */
+void flog_open(const char *path, int self, struct dsm_region *r,
+	       int nhandlers);
+
+/* Handler h served a fault with flags at addr of thread tid, read at t
+ * and woken latency ns later.
+ */
+void flog_record(int h, unsigned long addr, int flags, pid_t tid,
+		 unsigned long t, unsigned long latency);
+
+#define PROF_SLICES 64		/* Parts of a page fault offsets fall in */
+
+/* Count what happens to each of the npages granules of this node's
+ * region from now on. Call it before the runtime starts; the counters
+ * below do nothing without it.
+ */
+void prof_init(int self, unsigned long npages, unsigned long granule);
+
+/* A fault at byte off of the granule, a copy dropped for another node,
+ * the page's writes changing hands (write permission gained under MSI,
+ * a flush home under LRC), and n bytes of the page received.
+ */
+void prof_fault(unsigned long pgno, unsigned long off, int write);
+void prof_inval(unsigned long pgno);
+void prof_transfer(unsigned long pgno);
+void prof_bytes(unsigned long pgno, unsigned long n);
+
+/* Write the counters of every granule that saw any activity to f as
+ * text, for prof_report.
+ */
+void prof_write(FILE *f);
+
+/* Access traces, for replaying what an application did against another
+ * build or configuration. A trace is a header and fixed-size records in
+ * the byte order of the machine that wrote it; traces of several nodes
+ * may be concatenated into one file.
+ */
+enum trace_op {
+	TRACE_READ,		/* Bytes of a granule read */
+	TRACE_WRITE,		/* ... written */
+	TRACE_ACQUIRE,
+	TRACE_RELEASE,
+	TRACE_LOCK,		/* page is the lock */
+	TRACE_UNLOCK,
+	TRACE_BARRIER,
+	TRACE_OPS,
+};
+
+struct trace_rec {
+	uint16_t node;
+	uint16_t op;
+	uint32_t thread;	/* Index among the threads of the node */
+	uint64_t page;
+	uint32_t offset;	/* Byte within the granule */
+	uint32_t length;
+	uint64_t think_ns;	/* Since the thread's previous record ended */
+};
+
+/* A loaded trace.
+ */
+struct trace {
+	unsigned long pages;	/* Size of the region, in granules */
+	unsigned long granule;
+	int nnodes;		/* Highest node recorded, plus one */
+	unsigned long n;
+	struct trace_rec *rec;
+};
+
+/* Record what this node's threads do to its region of npages granules
+ * from now on: every fault, taken as an access of one byte, and every
+ * dsm_acquire(), dsm_release(), dsm_lock(), dsm_unlock() and
+ * dsm_barrier(). The hooks below do nothing without it.
+ */
+void trace_record_start(int self, unsigned long npages,
+			unsigned long granule);
+
+/* Thread tid faulted at byte off of granule pgno at start, and was woken
+ * at end; the calling thread did a synchronization op on lock arg that
+ * began at start.
+ */
+void trace_fault(pid_t tid, unsigned long pgno, unsigned long off,
+		 int write, unsigned long start, unsigned long end);
+void trace_sync(int op, unsigned int arg, unsigned long start);
+
+/* Write what was recorded so far to f.
+ */
+void trace_write(FILE *f);
+
+/* Read the trace at path into t, or exit if it is malformed.
+ */
+void trace_load(const char *path, struct trace *t);
+
+/* Replay the records of node self against base, a thread for each
+ * thread of the node, and return the number of records done. With timed
+ * every thread also waits out its think times.
+ */
+unsigned long trace_replay(const struct trace *t, char *base, int self,
+			   int timed);
+
+#endif
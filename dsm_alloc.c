@@ -0,0 +1,284 @@
+/* dsm_alloc.c
+
+   An arena allocator over the shared region. The region is cut into
+   spans, each a whole number of granules, and a span belongs to one node
+   and holds objects of one size class, or is part of a single large
+   object. Objects of different nodes therefore never share a granule and
+   never bounce between nodes because of each other. Sizes are multiples
+   of a cache line and every object starts on one.
+
+   The span table at the start of the region says who owns each span and
+   is only touched under DSM_ALLOC_LOCK. A node hands out the objects of
+   its own spans from bitmaps in private memory, without messages; an
+   object freed by another node goes on its span's list of remote frees
+   in the table, which the owner takes back once it runs short.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsm.h"
+
+#define LINE 64			/* Cache line, the allocation unit */
+#define MIN_SPAN (64UL << 10)
+#define MAX_CLASSES 32
+#define LARGE 0xff		/* Span class of large objects */
+
+/* Entry of the shared span table. All zero is a free span.
+ */
+struct span_entry {
+	uint16_t owner;		/* Owning node + 1 */
+	uint8_t cls;		/* Size class, or LARGE */
+	uint8_t pad;
+	uint32_t run;		/* LARGE: spans of the object at its first */
+	uint64_t remote;	/* Offset + 1 of the first remote free, or 0 */
+};
+
+/* One of our spans of small objects.
+ */
+struct span {
+	unsigned long idx;
+	int cls;
+	unsigned long nfree;
+	int listed;		/* On partial[cls] */
+	struct span *next;	/* ... next there */
+	struct span *next_own;	/* Next of our spans of the class */
+	uint64_t bits[];	/* Set for free slots */
+};
+
+static char *base;
+static struct span_entry *table;
+static unsigned long span_size;
+static unsigned long num_spans;
+static unsigned long first_span;	/* Spans after the table */
+static unsigned long next_free;	/* Where to look for a free span */
+static int num_classes;
+static uint16_t owner;
+
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct span **mine;	/* Our small-object spans, by index */
+static struct span *partial[MAX_CLASSES];
+static struct span *own[MAX_CLASSES];
+
+static unsigned long
+class_size(int cls)
+{
+	return (unsigned long) LINE << cls;
+}
+
+static unsigned long
+class_slots(int cls)
+{
+	return span_size / class_size(cls);
+}
+
+void
+alloc_init(struct dsm_region *r, int self)
+{
+	base = r->base;
+	table = (struct span_entry *) base;
+	span_size = r->granule;
+	while (span_size < MIN_SPAN)
+		span_size *= 2;
+	num_spans = r->len / span_size;
+	first_span = (num_spans * sizeof(*table) + span_size - 1) / span_size;
+	next_free = first_span;
+	owner = self + 1;
+
+	/* Anything larger than an eighth of a span takes whole spans */
+	for (num_classes = 0; class_size(num_classes) <= span_size / 8;
+	     num_classes++)
+		;
+
+	mine = calloc(num_spans, sizeof(*mine));
+	if (mine == NULL && num_spans > 0)
+		errExit("calloc");
+}
+
+static void
+push_partial(struct span *sp)
+{
+	sp->next = partial[sp->cls];
+	partial[sp->cls] = sp;
+	sp->listed = 1;
+}
+
+/* Take back the objects of class cls other nodes have freed. Called with
+ * DSM_ALLOC_LOCK and alloc_lock held.
+ */
+static void
+reclaim(int cls)
+{
+	struct span *sp;
+	uint64_t off, slot;
+
+	for (sp = own[cls]; sp; sp = sp->next_own) {
+		off = table[sp->idx].remote;
+		table[sp->idx].remote = 0;
+		for (; off != 0; off = *(uint64_t *) (base + off - 1)) {
+			slot = (off - 1 - sp->idx * span_size) / class_size(cls);
+			sp->bits[slot / 64] |= 1UL << (slot % 64);
+			sp->nfree++;
+		}
+		if (sp->nfree > 0 && !sp->listed)
+			push_partial(sp);
+	}
+}
+
+/* Index of the first of n consecutive free spans, marked as ours with
+ * class cls, or 0 if there are none. Called with DSM_ALLOC_LOCK held.
+ */
+static unsigned long
+claim_spans(unsigned long n, int cls)
+{
+	unsigned long i, k, start;
+
+	for (k = 0; k < num_spans - first_span; k++) {
+		start = first_span + (next_free - first_span + k) %
+			(num_spans - first_span);
+		if (start + n > num_spans)
+			continue;
+		for (i = 0; i < n && table[start + i].owner == 0; i++)
+			;
+		if (i < n)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			table[start + i].owner = owner;
+			table[start + i].cls = cls;
+			table[start + i].run = i == 0 ? n : 0;
+			table[start + i].remote = 0;
+		}
+		next_free = start + n < num_spans ? start + n : first_span;
+		return start;
+	}
+	return 0;
+}
+
+/* Find a span of class cls with room, from remote frees or a new span.
+ * Called with alloc_lock held.
+ */
+static void
+refill(int cls)
+{
+	unsigned long idx, slots = class_slots(cls);
+	struct span *sp;
+
+	dsm_lock(DSM_ALLOC_LOCK);
+	reclaim(cls);
+	if (partial[cls] == NULL && (idx = claim_spans(1, cls)) != 0) {
+		sp = calloc(1, sizeof(*sp) + (slots + 63) / 64 * sizeof(uint64_t));
+		if (sp == NULL)
+			errExit("calloc");
+		sp->idx = idx;
+		sp->cls = cls;
+		sp->nfree = slots;
+		for (unsigned long s = 0; s < slots; s++)
+			sp->bits[s / 64] |= 1UL << (s % 64);
+		sp->next_own = own[cls];
+		own[cls] = sp;
+		mine[idx] = sp;
+		push_partial(sp);
+	}
+	dsm_unlock(DSM_ALLOC_LOCK);
+}
+
+static void *
+alloc_large(size_t size)
+{
+	unsigned long idx;
+
+	dsm_lock(DSM_ALLOC_LOCK);
+	idx = claim_spans((size + span_size - 1) / span_size, LARGE);
+	dsm_unlock(DSM_ALLOC_LOCK);
+	return idx ? base + idx * span_size : NULL;
+}
+
+void *
+dsm_malloc(size_t size)
+{
+	struct span *sp;
+	unsigned long w, slot;
+	int cls = 0;
+
+	if (num_spans == 0 || size > num_spans * span_size)
+		return NULL;
+	size = size ? (size + LINE - 1) & ~(size_t) (LINE - 1) : LINE;
+	if (size > class_size(num_classes - 1))
+		return alloc_large(size);
+	while (class_size(cls) < size)
+		cls++;
+
+	pthread_mutex_lock(&alloc_lock);
+	if (partial[cls] == NULL)
+		refill(cls);
+	sp = partial[cls];
+	if (sp == NULL) {
+		pthread_mutex_unlock(&alloc_lock);
+		return NULL;
+	}
+
+	for (w = 0; sp->bits[w] == 0; w++)
+		;
+	slot = w * 64 + __builtin_ctzl(sp->bits[w]);
+	sp->bits[w] &= sp->bits[w] - 1;
+	if (--sp->nfree == 0) {
+		partial[cls] = sp->next;
+		sp->listed = 0;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	return base + sp->idx * span_size + slot * class_size(cls);
+}
+
+void
+dsm_free(void *ptr)
+{
+	unsigned long off, idx, slot;
+	struct span_entry *e;
+	struct span *sp;
+
+	if (ptr == NULL)
+		return;
+	off = (char *) ptr - base;
+	idx = off / span_size;
+	if ((char *) ptr < base || idx < first_span || idx >= num_spans) {
+		fprintf(stderr, "dsm_free() of %p outside the arena\n", ptr);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Our own objects go straight back */
+	pthread_mutex_lock(&alloc_lock);
+	sp = mine[idx];
+	if (sp) {
+		slot = (off - idx * span_size) / class_size(sp->cls);
+		sp->bits[slot / 64] |= 1UL << (slot % 64);
+		if (sp->nfree++ == 0 && !sp->listed)
+			push_partial(sp);
+		pthread_mutex_unlock(&alloc_lock);
+		return;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	dsm_lock(DSM_ALLOC_LOCK);
+	e = &table[idx];
+	if (e->owner == 0 ||
+	    (e->cls == LARGE && (e->run == 0 || off % span_size != 0))) {
+		fprintf(stderr, "dsm_free() of %p, which is not allocated\n",
+			ptr);
+		exit(EXIT_FAILURE);
+	}
+	if (e->cls == LARGE) {
+		memset(e, 0, e->run * sizeof(*e));
+	} else {
+		*(uint64_t *) ptr = e->remote;
+		e->remote = off + 1;
+	}
+	dsm_unlock(DSM_ALLOC_LOCK);
+}
@@ -0,0 +1,203 @@
+/* dsm_cluster.c
+
+   Cluster membership and the connections between its nodes. The
+   membership list names every node by host and port; a node's ID is its
+   position in the list. Every pair of nodes shares a main TCP
+   connection and DSM_DATA_LANES more for page contents, all opened by
+   the node with the higher ID. Nodes that turn out to share a
+   host also get a shared memory link, see dsm_shm.c, which their
+   messages take instead once msi_add_peer() is called.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "dsm.h"
+
+static int lanes[MAX_NODES][DSM_DATA_LANES];
+static int connected;		/* lanes is filled in */
+
+int
+cluster_load(const char *path, struct dsm_node *nodes)
+{
+	char line[512], *p;
+	FILE *f;
+	int n = 0;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		errExit("fopen");
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		if (n == MAX_NODES) {
+			fprintf(stderr, "%s: more than %d nodes\n", path,
+				MAX_NODES);
+			exit(EXIT_FAILURE);
+		}
+		if (sscanf(p, "%255s %15s", nodes[n].host, nodes[n].port) != 2) {
+			fprintf(stderr, "%s: expected \"host port\": %s", path, p);
+			exit(EXIT_FAILURE);
+		}
+		n++;
+	}
+	fclose(f);
+
+	if (n == 0) {
+		fprintf(stderr, "%s: no nodes\n", path);
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
+
+static struct addrinfo *
+resolve(struct dsm_node *node, int passive)
+{
+	struct addrinfo hints, *ai;
+	int s;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	s = getaddrinfo(passive ? NULL : node->host, node->port, &hints, &ai);
+	if (s != 0) {
+		fprintf(stderr, "%s:%s: %s\n", node->host, node->port,
+			gai_strerror(s));
+		exit(EXIT_FAILURE);
+	}
+	return ai;
+}
+
+static int
+listen_on(struct dsm_node *node, int backlog)
+{
+	struct addrinfo *ai = resolve(node, 1);
+	int fd, opt = 1;
+
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd == -1)
+		errExit("socket");
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
+		       &opt, sizeof(opt)) == -1)
+		errExit("setsockopt");
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+		errExit("bind");
+	if (listen(fd, backlog) == -1)
+		errExit("listen");
+	freeaddrinfo(ai);
+	return fd;
+}
+
+/* Connect to node, waiting for it to come up.
+ */
+static int
+connect_to(struct dsm_node *node)
+{
+	struct addrinfo *ai = resolve(node, 0);
+	int fd;
+
+	for (;;) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			errExit("socket");
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		printf("Connecting to %s:%s\n", node->host, node->port);
+		sleep(1);
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+/* The socket of connection k to node: the main one for k 0, else a lane.
+ */
+static int *
+conn(int *fd, int node, int k)
+{
+	return k == 0 ? &fd[node] : &lanes[node][k - 1];
+}
+
+void
+cluster_connect(int self, int nnodes, struct dsm_node *nodes, int *fd,
+		int with_lanes)
+{
+	int lfd = -1, hello[2], c;
+	int nconn = with_lanes ? DSM_DATA_LANES + 1 : 1;
+
+	for (int i = 0; i < nnodes; i++)
+		for (int k = 0; k <= DSM_DATA_LANES; k++)
+			*conn(fd, i, k) = -1;
+
+	/* Listen before connecting anywhere, so that nodes with higher IDs
+	 * can queue up in the backlog while we wait for lower ones.
+	 */
+	if (self < nnodes - 1)
+		lfd = listen_on(&nodes[self], nnodes * nconn);
+
+	/* Each connection opens with the ID of the connecting node and
+	 * which of its connections it is.
+	 */
+	for (int i = 0; i < self; i++) {
+		for (int k = 0; k < nconn; k++) {
+			c = connect_to(&nodes[i]);
+			hello[0] = self;
+			hello[1] = k;
+			if (write(c, hello, sizeof(hello)) != sizeof(hello))
+				errExit("write");
+			*conn(fd, i, k) = c;
+		}
+	}
+
+	for (int i = 0; i < (nnodes - self - 1) * nconn; i++) {
+		c = accept(lfd, NULL, NULL);
+		if (c == -1)
+			errExit("accept");
+		if (read(c, hello, sizeof(hello)) != sizeof(hello))
+			errExit("read");
+		if (hello[0] <= self || hello[0] >= nnodes || hello[1] < 0 ||
+		    hello[1] >= nconn ||
+		    *conn(fd, hello[0], hello[1]) != -1) {
+			fprintf(stderr, "Unexpected connection from node %d\n",
+				hello[0]);
+			exit(EXIT_FAILURE);
+		}
+		*conn(fd, hello[0], hello[1]) = c;
+	}
+
+	if (lfd != -1)
+		close(lfd);
+	connected = 1;
+	shm_negotiate(self, nnodes, fd);
+	printf("Node %d of %d connected\n", self, nnodes);
+}
+
+int
+cluster_lane(int node, int lane)
+{
+	return connected ? lanes[node][lane] : -1;
+}
+
+void
+cluster_close_lanes(int node)
+{
+	if (!connected)
+		return;
+	for (int k = 0; k < DSM_DATA_LANES; k++) {
+		if (lanes[node][k] != -1)
+			close(lanes[node][k]);
+		lanes[node][k] = -1;
+	}
+}
@@ -0,0 +1,239 @@
+/* dsm_diff.c
+
+   Run-length diffs between two versions of a page. A diff is a list of
+   runs, each a struct diff_run followed by the new bytes of the run; the
+   runs are in order and do not overlap. Finding the changed blocks is the
+   hot part and compares 32 bytes at a time with AVX2 where the CPU has
+   it, 16 with SSE2 otherwise. The check for an all-zero page works the
+   same way.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "dsm.h"
+
+#define BLOCK 32		/* Bytes compared at once; granules are multiples */
+
+struct diff_run {
+	uint32_t off;
+	uint32_t len;
+};
+
+/* Set bit i of *mask if block i of the 64 blocks at a and b differs.
+ */
+typedef void (*cmp_fn)(const char *a, const char *b, uint64_t *mask);
+
+/* Whether the 64 blocks at a are all zero.
+ */
+typedef int (*zero_fn)(const char *a);
+
+#if defined(__x86_64__)
+static void
+cmp_sse2(const char *a, const char *b, uint64_t *mask)
+{
+	__m128i x, y;
+
+	*mask = 0;
+	for (int i = 0; i < 64; i++) {
+		x = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i * BLOCK)),
+				   _mm_loadu_si128((const __m128i *) (b + i * BLOCK)));
+		y = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i * BLOCK + 16)),
+				   _mm_loadu_si128((const __m128i *) (b + i * BLOCK + 16)));
+		if (_mm_movemask_epi8(_mm_and_si128(x, y)) != 0xffff)
+			*mask |= 1UL << i;
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+cmp_avx2(const char *a, const char *b, uint64_t *mask)
+{
+	__m256i x;
+
+	*mask = 0;
+	for (int i = 0; i < 64; i++) {
+		x = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i * BLOCK)),
+				      _mm256_loadu_si256((const __m256i *) (b + i * BLOCK)));
+		if ((uint32_t) _mm256_movemask_epi8(x) != 0xffffffff)
+			*mask |= 1UL << i;
+	}
+}
+
+static int
+zero_sse2(const char *a)
+{
+	__m128i x = _mm_setzero_si128();
+
+	for (int i = 0; i < 64 * BLOCK; i += 16)
+		x = _mm_or_si128(x, _mm_loadu_si128((const __m128i *) (a + i)));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) == 0xffff;
+}
+
+__attribute__((target("avx2")))
+static int
+zero_avx2(const char *a)
+{
+	__m256i x = _mm256_setzero_si256();
+
+	for (int i = 0; i < 64 * BLOCK; i += 32)
+		x = _mm256_or_si256(x, _mm256_loadu_si256((const __m256i *) (a + i)));
+	return _mm256_testz_si256(x, x);
+}
+#else
+static int
+zero_scalar(const char *a)
+{
+	uint64_t x = 0, v;
+
+	for (int i = 0; i < 64 * BLOCK; i += sizeof(v)) {
+		memcpy(&v, a + i, sizeof(v));
+		x |= v;
+	}
+	return x == 0;
+}
+
+static void
+cmp_scalar(const char *a, const char *b, uint64_t *mask)
+{
+	*mask = 0;
+	for (int i = 0; i < 64; i++)
+		if (memcmp(a + i * BLOCK, b + i * BLOCK, BLOCK) != 0)
+			*mask |= 1UL << i;
+}
+#endif
+
+static cmp_fn
+pick_cmp(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return cmp_avx2;
+	return cmp_sse2;
+#else
+	return cmp_scalar;
+#endif
+}
+
+static zero_fn
+pick_zero(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return zero_avx2;
+	return zero_sse2;
+#else
+	return zero_scalar;
+#endif
+}
+
+/* Append the changed blocks [start, end) of cur to out, trimmed to the
+ * bytes that differ from twin, unless that would pass max.
+ */
+static int
+put_run(char *out, size_t *n, size_t max, const char *twin, const char *cur,
+	size_t start, size_t end)
+{
+	struct diff_run run;
+
+	while (twin[start] == cur[start])
+		start++;
+	while (twin[end - 1] == cur[end - 1])
+		end--;
+	if (*n + sizeof(run) + (end - start) > max)
+		return -1;
+	run.off = start;
+	run.len = end - start;
+	memcpy(out + *n, &run, sizeof(run));
+	memcpy(out + *n + sizeof(run), cur + start, end - start);
+	*n += sizeof(run) + (end - start);
+	return 0;
+}
+
+ssize_t
+diff_encode(const char *twin, const char *cur, size_t len, char *out,
+	    size_t max)
+{
+	static cmp_fn cmp;
+	size_t n = 0, off, start = 0, end = 0;
+	uint64_t mask;
+	int open = 0;
+
+	if (cmp == NULL)
+		cmp = pick_cmp();
+
+	/* Changed blocks next to each other make one run */
+	for (off = 0; off < len; off += 64 * BLOCK) {
+		if (len - off < 64 * BLOCK) {
+			mask = 0;
+			for (size_t i = 0; off + i * BLOCK < len; i++)
+				if (memcmp(twin + off + i * BLOCK,
+					   cur + off + i * BLOCK, BLOCK) != 0)
+					mask |= 1UL << i;
+		} else {
+			cmp(twin + off, cur + off, &mask);
+		}
+
+		for (int i = 0; i < 64 && off + i * BLOCK < len; i++) {
+			if (mask & (1UL << i)) {
+				if (!open)
+					start = off + i * BLOCK;
+				open = 1;
+				end = off + (i + 1) * BLOCK;
+				continue;
+			}
+			if (!open)
+				continue;
+			if (put_run(out, &n, max, twin, cur, start, end) == -1)
+				return -1;
+			open = 0;
+		}
+	}
+	if (open && put_run(out, &n, max, twin, cur, start, end) == -1)
+		return -1;
+	return n;
+}
+
+int
+diff_apply(char *page, size_t len, const char *diff, size_t dlen)
+{
+	struct diff_run run;
+	size_t n = 0;
+
+	while (n < dlen) {
+		if (dlen - n < sizeof(run))
+			return -1;
+		memcpy(&run, diff + n, sizeof(run));
+		n += sizeof(run);
+		if (run.len > dlen - n || run.off > len || run.len > len - run.off)
+			return -1;
+		memcpy(page + run.off, diff + n, run.len);
+		n += run.len;
+	}
+	return 0;
+}
+
+int
+page_is_zero(const char *page, size_t len)
+{
+	static zero_fn zero;
+	size_t off;
+
+	if (zero == NULL)
+		zero = pick_zero();
+
+	/* Most pages that are not zero give up in the first chunk */
+	for (off = 0; off + 64 * BLOCK <= len; off += 64 * BLOCK)
+		if (!zero(page + off))
+			return 0;
+	for (; off < len; off++)
+		if (page[off] != 0)
+			return 0;
+	return 1;
+}
@@ -0,0 +1,573 @@
+/* dsm_fault.c
+
+   The fault handlers. The reactor reads the region's userfaultfd and
+   queues the faults; a pool of threads takes them in batches, asks the
+   coherence engine for the granules, installs what comes back and wakes
+   the faulting threads. Granules ahead of sequential streams are fetched
+   once those threads run again.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <linux/userfaultfd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "dsm.h"
+
+#define MAX_HANDLERS 64
+#define MAX_BATCH 64		/* Messages drained by a single read() */
+#define STAGING_SIZE (4UL << 20)	/* Staging memory of one handler */
+
+static struct dsm_region *rgn;	/* The shared region */
+static unsigned long granule;	/* Coherence unit, rgn->granule */
+static int num_slots;		/* Granules that fit in the staging area */
+static int prefetch_window;
+static int trace;		/* Print every fault */
+
+/* One faulting granule of a batch.
+ */
+struct fault {
+	unsigned long addr;	/* Granule-aligned faulting address */
+	int write;		/* Some thread wants to write the page */
+	int result;		/* Where the request for the granule stands */
+	int ready;		/* Reply is in, granule not yet installed */
+	unsigned long t_read;	/* When the fault was read, 0 for prefetches */
+	unsigned long t_sent;	/* When the request went out */
+};
+
+/* Per-thread state of one fault handler. Every handler drains the same
+ * userfaultfd, so the messages and staging pages must not be shared.
+ */
+struct fault_handler {
+	pthread_t thr;		/* ID of the handler thread */
+	int id;			/* Index within the pool */
+	long uffd;		/* userfaultfd file descriptor */
+	char *page;		/* num_slots staging granules for UFFDIO_COPY */
+	struct uffd_msg msg[MAX_BATCH];	/* Faults taken from the queue */
+	unsigned long t_read[MAX_BATCH];	/* ... and when they were read */
+	struct fault fault[MAX_BATCH];
+	struct fault pf[MAX_BATCH];	/* Granules to prefetch */
+	unsigned long pfn[MAX_BATCH];
+	struct msi_wait wait[MAX_BATCH];	/* Outstanding requests, by slot */
+	struct msi_notify notify;	/* Signalled as their replies come in */
+};
+
+static struct fault_handler handlers[MAX_HANDLERS];
+static int num_handlers;
+static char *zeros;		/* num_slots granules that read as zero */
+
+/* Fault messages read by the reactor, waiting for a handler.
+ */
+struct fault_batch {
+	int n;
+	unsigned long t;	/* When the read() started */
+	struct uffd_msg msg[MAX_BATCH];
+	struct fault_batch *next;
+};
+
+static struct fault_batch *batch_head, *batch_tail;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+
+static int
+cmp_addr(const void *a, const void *b)
+{
+	unsigned long x = ((const struct fault *) a)->addr;
+	unsigned long y = ((const struct fault *) b)->addr;
+
+	return (x > y) - (x < y);
+}
+
+/* Install npages consecutive granules at dst from src without waking the
+ * faulting threads. Read-only copies are installed write-protected so
+ * that the first write to them traps. Pages that are already present are
+ * skipped.
+ *
+ * Writable granules from zeros map the shared zero page instead of
+ * copying. UFFDIO_ZEROPAGE cannot write-protect, and protecting afterwards
+ * would let a local write slip in between, so read-only ones are copied.
+ * Huge pages have no zero page to map.
+ */
+static void
+copy_run(struct fault_handler *fh, char *src, unsigned long dst, int npages,
+	 int write)
+{
+	struct uffdio_copy uffdio_copy;
+	struct uffdio_zeropage zp;
+	unsigned long start = dst;
+	unsigned long end = dst + npages * granule;
+	long done;
+	int r;
+
+	while (dst < end) {
+		if (src == zeros && write && rgn->backing == DSM_ANON) {
+			zp.range.start = dst;
+			zp.range.len = end - dst;
+			zp.mode = UFFDIO_ZEROPAGE_MODE_DONTWAKE;
+			zp.zeropage = 0;
+			r = ioctl(fh->uffd, UFFDIO_ZEROPAGE, &zp);
+			done = zp.zeropage;
+		} else {
+			uffdio_copy.src = (unsigned long) src + (dst - start);
+			uffdio_copy.dst = dst;
+			uffdio_copy.len = end - dst;
+			uffdio_copy.mode = UFFDIO_COPY_MODE_DONTWAKE;
+			if (!write)
+				uffdio_copy.mode |= UFFDIO_COPY_MODE_WP;
+			uffdio_copy.copy = 0;
+			r = ioctl(fh->uffd, UFFDIO_COPY, &uffdio_copy);
+			done = uffdio_copy.copy;
+		}
+
+		if (r == 0)
+			return;
+
+		if (errno != EEXIST && errno != EAGAIN)
+			errExit(src == zeros ? "ioctl-UFFDIO_ZEROPAGE" :
+				"ioctl-UFFDIO_COPY");
+
+		/* Skip what was installed and, on EEXIST, the page that is
+		 * already present.
+		 */
+		if (done > 0)
+			dst += done;
+		else if (errno == EEXIST)
+			dst += granule;
+	}
+}
+
+/* Make a page that is now Modified writable again. Upgrades of a Shared
+ * copy take this path and move no data.
+ */
+static void
+unprotect(struct fault_handler *fh, unsigned long addr)
+{
+	struct uffdio_writeprotect wp;
+
+	wp.range.start = addr;
+	wp.range.len = granule;
+	wp.mode = UFFDIO_WRITEPROTECT_MODE_DONTWAKE;
+	if (ioctl(fh->uffd, UFFDIO_WRITEPROTECT, &wp) == -1)
+		errExit("ioctl-UFFDIO_WRITEPROTECT");
+}
+
+/* Sort faults by address and merge those on the same granule; the
+ * merged fault asks for write access if any of them writes.
+ */
+static int
+merge_faults(struct fault *f, int n)
+{
+	int i, j;
+
+	qsort(f, n, sizeof(f[0]), cmp_addr);
+	for (i = 0, j = 0; i < n; i++) {
+		if (j > 0 && f[i].addr == f[j - 1].addr) {
+			f[j - 1].write |= f[i].write;
+			if (f[i].t_read < f[j - 1].t_read)
+				f[j - 1].t_read = f[i].t_read;
+		} else
+			f[j++] = f[i];
+	}
+	return j;
+}
+
+static unsigned long
+pgno_of(unsigned long addr)
+{
+	return (addr - (unsigned long) rgn->base) / granule;
+}
+
+/* Time ns spent in phase on fault f. Nobody waits for a prefetch, so
+ * those are left out.
+ */
+static void
+record(struct fault_handler *fh, struct fault *f, int phase, unsigned long ns)
+{
+	if (f->t_read != 0)
+		lat_record(fh->id, phase, ns);
+}
+
+/* Hand a fault that was read at t_read and woken at t_wake to the fault
+ * log and the access trace, which do nothing unless they are on.
+ */
+static void
+log_fault(struct fault_handler *fh, struct uffd_msg *msg,
+	  unsigned long t_read, unsigned long t_wake)
+{
+	unsigned long addr = msg->arg.pagefault.address;
+	int write = (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE) != 0;
+	int wp = (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) != 0;
+
+	flog_record(fh->id, addr, (write ? FLOG_WRITE : 0) | (wp ? FLOG_WP : 0),
+		    msg->arg.pagefault.feat.ptid, t_read, t_wake - t_read);
+	trace_fault(msg->arg.pagefault.feat.ptid, pgno_of(addr),
+		    addr & (granule - 1), write, t_read, t_wake);
+}
+
+/* Install the granules whose replies are in and let their homes move
+ * on.
+ */
+static void
+settle(struct fault_handler *fh, struct fault *f, int n)
+{
+	unsigned long t;
+	int i, j;
+
+	/* [H8: point 1]
+	 * Handle page faults in unit of granules. Fetched granules at
+	 * adjacent addresses with the same access are merged into one
+	 * multi-granule copy, and so are zero granules.
+	 */
+	for (i = 0; i < n; i = j) {
+		if (!f[i].ready || (f[i].result != MSI_FETCHED &&
+				    f[i].result != MSI_ZERO)) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < n; j++) {
+			if (!f[j].ready || f[j].result != f[i].result ||
+			    f[j].write != f[i].write ||
+			    f[j].addr != f[j - 1].addr + granule)
+				break;
+		}
+		t = lat_now();
+		copy_run(fh, f[i].result == MSI_ZERO ? zeros :
+			 fh->page + i * granule, f[i].addr, j - i, f[i].write);
+		record(fh, &f[i], LAT_COPY, lat_now() - t);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!f[i].ready)
+			continue;
+		if (f[i].result == MSI_GRANTED) {
+			t = lat_now();
+			unprotect(fh, f[i].addr);
+			record(fh, &f[i], LAT_COPY, lat_now() - t);
+		}
+		msi_complete(pgno_of(f[i].addr), f[i].write);
+		f[i].ready = 0;
+		f[i].result = MSI_PRESENT;
+	}
+}
+
+/* Resolve n distinct faulting granules, n <= num_slots, sorted by address.
+ */
+static void
+service_faults(struct fault_handler *fh, struct fault *f, int n)
+{
+	unsigned long seen, t;
+	int i, pending = 0;
+
+	pthread_mutex_lock(&fh->notify.lock);
+	seen = fh->notify.count;
+	pthread_mutex_unlock(&fh->notify.lock);
+
+	/* Ask for every granule at once, so that the round trips overlap.
+	 * The contents land in the granule's staging slot.
+	 */
+	for (i = 0; i < n; i++) {
+		fh->wait[i].buf = fh->page + i * granule;
+		fh->wait[i].notify = &fh->notify;
+		f[i].ready = 0;
+		t = lat_now();
+		f[i].result = msi_fetch_begin(pgno_of(f[i].addr), f[i].write,
+					      &fh->wait[i]);
+		f[i].t_sent = lat_now();
+		record(fh, &f[i], LAT_LOOKUP, f[i].t_sent - t);
+		if (f[i].result == MSI_PENDING)
+			pending++;
+	}
+
+	/* Install granules as their replies come in. A granule that has
+	 * arrived is never held while waiting for the others: its home keeps
+	 * it busy until it is installed, and another node may be waiting for
+	 * it while holding one of ours.
+	 */
+	while (pending > 0) {
+		pthread_mutex_lock(&fh->notify.lock);
+		while (fh->notify.count == seen)
+			pthread_cond_wait(&fh->notify.cond, &fh->notify.lock);
+		seen = fh->notify.count;
+		pthread_mutex_unlock(&fh->notify.lock);
+
+		for (i = 0; i < n; i++) {
+			if (f[i].result != MSI_PENDING ||
+			    !msi_fetch_done(pgno_of(f[i].addr), &fh->wait[i]))
+				continue;
+			f[i].result = msi_fetch_end(pgno_of(f[i].addr),
+						    &fh->wait[i]);
+			record(fh, &f[i], LAT_NETWORK, lat_now() - f[i].t_sent);
+			f[i].ready = 1;
+			pending--;
+		}
+		settle(fh, f, n);
+	}
+
+	/* Another handler was already fetching these; with nothing held any
+	 * more, wait for it and see whether that was enough.
+	 */
+	for (i = 0; i < n; i++) {
+		if (f[i].result != MSI_BUSY)
+			continue;
+		t = lat_now();
+		f[i].result = msi_fetch(pgno_of(f[i].addr), f[i].write,
+					fh->page + i * granule);
+		record(fh, &f[i], LAT_NETWORK, lat_now() - t);
+		f[i].ready = f[i].result != MSI_PRESENT;
+		settle(fh, f, n);
+	}
+}
+
+/* Called by the reactor whenever the userfaultfd is readable.
+ */
+static void
+uffd_ready(int fd, void *arg)
+{
+	struct fault_batch *b;
+	unsigned long t;
+	ssize_t nread;
+
+	/* [H3: point 1]
+	 * The reactor has polled the userfaultfd; get the data along with its status.
+	 */
+	for (;;) {
+		b = malloc(sizeof(*b));
+		if (b == NULL)
+			errExit("malloc");
+
+		/* [H4: point 1]
+		 * Read the user specified argument and exit when reading is done or 
+		 * conditions for end of file argument are met..
+		 * Pending messages are drained a batch per read(), until none
+		 * are left.
+		 */
+		t = lat_now();
+		nread = read(fd, b->msg, sizeof(b->msg));
+		if (nread == 0) {
+			printf("EOF on userfaultfd!\n");
+			exit(EXIT_FAILURE);
+		}
+		if (nread == -1 && errno == EAGAIN) {
+			free(b);
+			return;
+		}
+		if (nread == -1)
+			errExit("read");
+
+		b->n = nread / sizeof(b->msg[0]);
+		b->t = t;
+		b->next = NULL;
+
+		pthread_mutex_lock(&batch_lock);
+		if (batch_tail)
+			batch_tail->next = b;
+		else
+			batch_head = b;
+		batch_tail = b;
+		pthread_cond_signal(&batch_cond);
+		pthread_mutex_unlock(&batch_lock);
+	}
+}
+
+/* Wait for faults and take as many queued batches as fit in max messages,
+ * along with when each was read.
+ */
+static int
+take_faults(struct uffd_msg *msg, unsigned long *t, int max)
+{
+	struct fault_batch *b;
+	int n = 0;
+
+	pthread_mutex_lock(&batch_lock);
+	while (batch_head == NULL)
+		pthread_cond_wait(&batch_cond, &batch_lock);
+	while ((b = batch_head) != NULL && n + b->n <= max) {
+		batch_head = b->next;
+		if (batch_head == NULL)
+			batch_tail = NULL;
+		memcpy(msg + n, b->msg, b->n * sizeof(msg[0]));
+		for (int i = 0; i < b->n; i++)
+			t[n + i] = b->t;
+		n += b->n;
+		free(b);
+	}
+	pthread_mutex_unlock(&batch_lock);
+
+	return n;
+}
+
+static void *
+fault_handler_thread(void *arg)
+{
+	struct fault_handler *fh = arg;
+	struct uffdio_range range;
+	unsigned long t;
+	int nmsg, nfault, npf, i, j;
+
+	/* [H1: point 1]
+	 * Creates a new mapping in the virtual address space of the calling process. Since address is NULL
+	 * kernel chooses page-aligned address to create the mapping.
+	 */
+	if (fh->page == NULL) {
+		fh->page = mmap(NULL, num_slots * granule,
+			    PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (fh->page == MAP_FAILED)
+			errExit("mmap");
+	}
+
+	/* [H2: point 1]
+	 * Loop for handling events from the userfaultfd file descriptor.
+	 * The reactor reads them; take what it has queued.
+	 */
+	for (;;) {
+		nmsg = take_faults(fh->msg, fh->t_read, MAX_BATCH);
+		t = lat_now();
+		nfault = 0;
+		for (i = 0; i < nmsg; i++) {
+			/* [H5: point 1]
+			 * Handle conditions when unexpected events occur on userfaultfd.
+			 */
+			if (fh->msg[i].event != UFFD_EVENT_PAGEFAULT) {
+				fprintf(stderr, "Unexpected event on userfaultfd\n");
+				exit(EXIT_FAILURE);
+			}
+
+			/* [H6: point 1]
+			 * Print the address and flags associated with the
+			 * pagefault event, if asked to: printing holds up the
+			 * handler.
+			 */
+			if (trace)
+				printf("[x] PAGEFAULT flags = %llx; address = %llx\n",
+				       fh->msg[i].arg.pagefault.flags,
+				       fh->msg[i].arg.pagefault.address);
+			lat_record(fh->id, LAT_READ, t - fh->t_read[i]);
+
+			/* [H9: point 1]
+			 * Round faulting address down to page boundary.
+			 */
+			fh->fault[nfault].addr = (unsigned long)
+				fh->msg[i].arg.pagefault.address & ~(granule - 1);
+			fh->fault[nfault].write = (fh->msg[i].arg.pagefault.flags &
+				UFFD_PAGEFAULT_FLAG_WRITE) != 0;
+			fh->fault[nfault].t_read = fh->t_read[i];
+			prof_fault(pgno_of(fh->fault[nfault].addr),
+				   fh->msg[i].arg.pagefault.address & (granule - 1),
+				   fh->fault[nfault].write);
+			nfault++;
+		}
+
+		/* Several threads faulting on the same granule share one
+		 * request.
+		 */
+		nfault = merge_faults(fh->fault, nfault);
+
+		for (i = 0; i < nfault; i += num_slots)
+			service_faults(fh, &fh->fault[i], nfault - i < num_slots ?
+				       nfault - i : num_slots);
+
+		/* Every copy and unprotect above was DONTWAKE; release all
+		 * the faulting threads of this batch at once.
+		 */
+		range.start = fh->fault[0].addr;
+		range.len = fh->fault[nfault - 1].addr + granule - fh->fault[0].addr;
+		if (ioctl(fh->uffd, UFFDIO_WAKE, &range) == -1)
+			errExit("ioctl-UFFDIO_WAKE");
+		t = lat_now();
+		for (i = 0; i < nfault; i++)
+			lat_record(fh->id, LAT_TOTAL, t - fh->fault[i].t_read);
+		for (i = 0; i < nmsg; i++)
+			log_fault(fh, &fh->msg[i], fh->t_read[i], t);
+
+		/* With the faulting threads running again, fetch what their
+		 * streams are going to touch next. Nobody waits for these, so
+		 * there is nothing to wake.
+		 */
+		npf = 0;
+		for (i = 0; i < nmsg && npf + prefetch_window <= MAX_BATCH; i++) {
+			unsigned long addr = fh->msg[i].arg.pagefault.address;
+			int write = (fh->msg[i].arg.pagefault.flags &
+				     UFFD_PAGEFAULT_FLAG_WRITE) != 0;
+			int n = prefetch_fault(fh->msg[i].arg.pagefault.feat.ptid,
+					       pgno_of(addr), write, fh->pfn);
+
+			for (j = 0; j < n; j++) {
+				if (msi_state(fh->pfn[j]) != MSI_INVALID)
+					continue;
+				fh->pf[npf].addr = (unsigned long) rgn->base +
+					fh->pfn[j] * granule;
+				fh->pf[npf].write = write;
+				fh->pf[npf].t_read = 0;
+				npf++;
+			}
+		}
+		npf = merge_faults(fh->pf, npf);
+		for (i = 0; i < npf; i += num_slots)
+			service_faults(fh, &fh->pf[i], npf - i < num_slots ?
+				       npf - i : num_slots);
+	}
+}
+
+void
+fault_start(struct dsm_region *r, int n, int window)
+{
+	long uffd = r->uffd;
+	int s;
+
+	if (n < 1 || n > MAX_HANDLERS) {
+		fprintf(stderr, "Number of handlers must be 1-%d\n", MAX_HANDLERS);
+		exit(EXIT_FAILURE);
+	}
+	if (window < 0 || window > MAX_PREFETCH) {
+		fprintf(stderr, "Prefetch window must be 0-%d\n", MAX_PREFETCH);
+		exit(EXIT_FAILURE);
+	}
+
+	rgn = r;
+	granule = r->granule;
+	prefetch_window = window;
+	prefetch_init(window, r->len / granule);
+	lat_init(n);
+
+	num_handlers = n;
+	num_slots = STAGING_SIZE / granule;
+	if (num_slots < 1)
+		num_slots = 1;
+	if (num_slots > MAX_BATCH)
+		num_slots = MAX_BATCH;
+	zeros = mmap(NULL, num_slots * granule, PROT_READ,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (zeros == MAP_FAILED)
+		errExit("mmap");
+	for (int i = 0; i < n; i++) {
+		handlers[i].id = i;
+		handlers[i].uffd = uffd;
+		handlers[i].page = NULL;
+		pthread_mutex_init(&handlers[i].notify.lock, NULL);
+		pthread_cond_init(&handlers[i].notify.cond, NULL);
+		handlers[i].notify.count = 0;
+		s = pthread_create(&handlers[i].thr, NULL, fault_handler_thread,
+				   &handlers[i]);
+		if (s != 0) {
+			errno = s;
+			errExit("pthread_create");
+		}
+	}
+
+	reactor_add(uffd, uffd_ready, NULL);
+}
+
+void
+fault_set_trace(int on)
+{
+	trace = on;
+}
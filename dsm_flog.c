@@ -0,0 +1,93 @@
+/* dsm_flog.c
+
+   The fault log. Each handler owns one ring of the log file and is its
+   only writer, so logging a fault takes a few stores and a release of
+   the ring's head: no lock, no atomic read-modify-write and no system
+   call. The file is mapped shared and populated up front, and the
+   kernel writes it back like any dirty page cache, also after a crash.
+   A reader of a live log may see the oldest event of a full ring being
+   overwritten; flog_report reads logs once the node is done.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "dsm.h"
+
+static char *log_base;		/* The mapped file, NULL while off */
+static int num_rings;
+
+static struct flog_ring *
+ring(int h)
+{
+	return (struct flog_ring *) (log_base + sizeof(struct flog_header) +
+				     h * FLOG_RING_SIZE(FLOG_EVENTS));
+}
+
+void
+flog_open(const char *path, int self, struct dsm_region *r, int nhandlers)
+{
+	struct flog_header *h;
+	struct timespec ts;
+	size_t size;
+	char *p;
+	int fd;
+
+	size = sizeof(*h) + nhandlers * FLOG_RING_SIZE(FLOG_EVENTS);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		errExit(path);
+	if (ftruncate(fd, size) == -1)
+		errExit("ftruncate");
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		 fd, 0);
+	if (p == MAP_FAILED)
+		errExit("mmap");
+	close(fd);
+
+	h = (struct flog_header *) p;
+	memcpy(h->magic, FLOG_MAGIC, sizeof(h->magic));
+	h->version = FLOG_VERSION;
+	h->node = self;
+	h->rings = nhandlers;
+	h->events = FLOG_EVENTS;
+	h->base = (unsigned long) r->base;
+	h->len = r->len;
+	h->granule = r->granule;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h->mono_ns = lat_now();
+	h->real_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+
+	num_rings = nhandlers;
+	__atomic_store_n(&log_base, p, __ATOMIC_RELEASE);
+}
+
+void
+flog_record(int h, unsigned long addr, int flags, pid_t tid, unsigned long t,
+	    unsigned long latency)
+{
+	struct flog_ring *r;
+	struct flog_event *e;
+	uint64_t head;
+
+	if (log_base == NULL || h >= num_rings)
+		return;
+	r = ring(h);
+	head = r->head;
+	e = &r->ev[head & (FLOG_EVENTS - 1)];
+	e->addr = addr;
+	e->t = t;
+	e->latency = latency > UINT32_MAX ? UINT32_MAX : latency;
+	e->tid = tid;
+	e->flags = flags;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
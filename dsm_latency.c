@@ -0,0 +1,294 @@
+/* dsm_latency.c
+
+   Latency histograms of the fault handlers, one set per handler so that
+   recording takes no lock: each histogram has a single writer, and
+   readers add up the counts of all handlers while they change. Buckets
+   are log-linear in the manner of HdrHistogram: values below
+   2^LAT_SUB_BITS nanoseconds are exact and every power of two above is
+   cut into 2^LAT_SUB_BITS buckets, which keeps the error under 7%.
+
+   An optional thread writes a snapshot of the percentiles every period,
+   to a file that is replaced whole or to a Unix socket.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dsm.h"
+
+#define SUB_BITS LAT_SUB_BITS
+#define MAX_BITS LAT_MAX_BITS	/* Values are clamped to about 4.9 hours */
+#define NBUCKETS LAT_BUCKETS
+#define UNIX_PREFIX "unix:"
+
+struct lat_hist {
+	uint64_t count[NBUCKETS];
+	uint64_t sum;
+	uint64_t max;
+};
+
+static const char *phase_names[LAT_PHASES] = {
+	"read", "lookup", "network", "copy", "total",
+};
+
+static struct lat_hist (*hists)[LAT_PHASES];	/* By handler and phase */
+static int num_hists;
+
+static char *export_dest;
+static int export_ms;
+static int export_fd = -1;	/* Connected Unix socket */
+
+unsigned long
+lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void
+lat_init(int nhandlers)
+{
+	hists = calloc(nhandlers, sizeof(*hists));
+	if (hists == NULL)
+		errExit("calloc");
+	num_hists = nhandlers;
+}
+
+static int
+bucket_of(uint64_t v)
+{
+	int msb;
+
+	if (v >> MAX_BITS)
+		v = (1UL << MAX_BITS) - 1;
+	if (v < (1U << SUB_BITS))
+		return v;
+	msb = 63 - __builtin_clzl(v);
+	return ((msb - SUB_BITS + 1) << SUB_BITS) +
+		((v >> (msb - SUB_BITS)) & ((1U << SUB_BITS) - 1));
+}
+
+/* Middle of the values that fall in bucket b.
+ */
+static uint64_t
+bucket_value(int b)
+{
+	int shift;
+
+	if (b < (1 << SUB_BITS))
+		return b;
+	shift = (b >> SUB_BITS) - 1;
+	return ((uint64_t) ((1 << SUB_BITS) + (b & ((1 << SUB_BITS) - 1)))
+		<< shift) + ((1UL << shift) >> 1);
+}
+
+static void
+add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void
+lat_record(int handler, int phase, unsigned long ns)
+{
+	struct lat_hist *h;
+
+	if (hists == NULL || handler >= num_hists)
+		return;
+	h = &hists[handler][phase];
+	add(&h->count[bucket_of(ns)], 1);
+	add(&h->sum, ns);
+	if (ns > h->max)
+		__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+void
+lat_counts(int phase, struct lat_counts *c)
+{
+	struct lat_hist *h;
+
+	memset(c, 0, sizeof(*c));
+	for (int i = 0; i < num_hists; i++) {
+		h = &hists[i][phase];
+		for (int b = 0; b < NBUCKETS; b++)
+			c->count[b] += __atomic_load_n(&h->count[b],
+						       __ATOMIC_RELAXED);
+		c->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	}
+	for (int b = 0; b < NBUCKETS; b++)
+		c->n += c->count[b];
+}
+
+void
+lat_counts_sub(struct lat_counts *c, const struct lat_counts *before)
+{
+	c->n -= before->n;
+	c->sum -= before->sum;
+	for (int b = 0; b < NBUCKETS; b++)
+		c->count[b] -= before->count[b];
+}
+
+unsigned long
+lat_quantile(const struct lat_counts *c, double q)
+{
+	unsigned long want = q * c->n, seen = 0;
+
+	for (int b = 0; b < NBUCKETS; b++) {
+		seen += c->count[b];
+		if (seen > want)
+			return bucket_value(b);
+	}
+	return 0;
+}
+
+/* lat_quantile() in microseconds, no larger than the largest value:
+ * a bucket's middle may lie past it.
+ */
+static double
+quantile_us(const struct lat_counts *c, unsigned long max, double q)
+{
+	unsigned long v = lat_quantile(c, q);
+
+	return (v < max ? v : max) / 1e3;
+}
+
+void
+lat_write(FILE *f)
+{
+	struct lat_counts c;
+	unsigned long max, m;
+
+	if (hists == NULL)
+		return;
+	fprintf(f, "dsm-latency at %ld handlers %d\n", (long) time(NULL),
+		num_hists);
+	fprintf(f, "%-8s %10s %10s %10s %10s %10s %10s %10s\n", "phase",
+		"count", "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us",
+		"max_us");
+	for (int p = 0; p < LAT_PHASES; p++) {
+		lat_counts(p, &c);
+		max = 0;
+		for (int i = 0; i < num_hists; i++) {
+			m = __atomic_load_n(&hists[i][p].max, __ATOMIC_RELAXED);
+			if (m > max)
+				max = m;
+		}
+		fprintf(f, "%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f "
+			"%10.1f\n", phase_names[p], c.n,
+			c.n ? c.sum / 1e3 / c.n : 0.0,
+			quantile_us(&c, max, 0.5), quantile_us(&c, max, 0.9),
+			quantile_us(&c, max, 0.99), quantile_us(&c, max, 0.999),
+			max / 1e3);
+	}
+}
+
+/* Write the snapshot to a temporary file and move it over the old one,
+ * so readers never see half of it.
+ */
+static void
+export_file(void)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", export_dest);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		perror(tmp);
+		return;
+	}
+	lat_write(f);
+	if (fclose(f) == 0 && rename(tmp, export_dest) == -1)
+		perror(export_dest);
+}
+
+/* Send the snapshot to whoever listens on the socket, connecting again
+ * after they went away.
+ */
+static void
+export_socket(void)
+{
+	const char *path = export_dest + strlen(UNIX_PREFIX);
+	struct sockaddr_un addr;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	if (export_fd == -1) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+		export_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (export_fd == -1)
+			errExit("socket");
+		if (connect(export_fd, (struct sockaddr *) &addr,
+			    sizeof(addr)) == -1) {
+			close(export_fd);
+			export_fd = -1;
+			return;
+		}
+	}
+
+	f = open_memstream(&buf, &len);
+	if (f == NULL)
+		errExit("open_memstream");
+	lat_write(f);
+	fclose(f);
+	if (send(export_fd, buf, len, MSG_NOSIGNAL) != (ssize_t) len) {
+		close(export_fd);
+		export_fd = -1;
+	}
+	free(buf);
+}
+
+static void *
+export_thread(void *arg)
+{
+	struct timespec ts;
+
+	ts.tv_sec = export_ms / 1000;
+	ts.tv_nsec = export_ms % 1000 * 1000000L;
+	for (;;) {
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+		ts.tv_sec = export_ms / 1000;
+		ts.tv_nsec = export_ms % 1000 * 1000000L;
+		if (strncmp(export_dest, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0)
+			export_socket();
+		else
+			export_file();
+	}
+	return NULL;
+}
+
+void
+lat_export(const char *dest, int period_ms)
+{
+	pthread_t thr;
+	int s;
+
+	export_dest = strdup(dest);
+	if (export_dest == NULL)
+		errExit("strdup");
+	export_ms = period_ms > 0 ? period_ms : LAT_EXPORT_MS;
+	s = pthread_create(&thr, NULL, export_thread, NULL);
+	if (s != 0) {
+		errno = s;
+		errExit("pthread_create");
+	}
+	pthread_detach(thr);
+}
@@ -0,0 +1,147 @@
+/* dsm_lib.c
+
+   The entry points of libdsm for programs that embed the runtime: join
+   the cluster, create the shared region, and leave. Everything between
+   is the region itself, dsm_malloc() and the synchronization calls.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "dsm.h"
+
+static struct dsm_config config;
+static int peer[MAX_NODES];
+static int joined;
+static struct dsm_region rgn;
+
+void
+dsm_init(const struct dsm_config *cfg)
+{
+	if (joined || rgn.base != NULL) {
+		fprintf(stderr, "The DSM runtime can be started once\n");
+		exit(EXIT_FAILURE);
+	}
+	if (cfg->nnodes < 1 || cfg->nnodes > MAX_NODES || cfg->self < 0 ||
+	    cfg->self >= cfg->nnodes || cfg->handlers < 0 ||
+	    cfg->prefetch < -1 || cfg->prefetch > MAX_PREFETCH) {
+		fprintf(stderr, "Bad DSM configuration\n");
+		exit(EXIT_FAILURE);
+	}
+
+	config = *cfg;
+	if (config.handlers == 0)
+		config.handlers = DEFAULT_HANDLERS;
+	if (config.prefetch == 0)
+		config.prefetch = DEFAULT_PREFETCH;
+	else if (config.prefetch == -1)
+		config.prefetch = 0;
+
+	shm_set(!config.no_shm);
+	cluster_connect(config.self, config.nnodes, config.nodes, peer,
+			!config.one_lane);
+	msi_set_diff(config.diff);
+	msi_set_compress(config.compress);
+	msi_set_migratory(!config.no_migratory);
+	msi_set_home_moves(!config.fixed_homes);
+	msi_set_lanes(!config.one_lane);
+	msi_set_lrc(config.lrc);
+	joined = 1;
+}
+
+char *
+dsm_region_create(unsigned long len, unsigned long granule, int backing)
+{
+	char path[PATH_MAX];
+	char *hint = NULL;
+
+	if (!joined || rgn.base != NULL) {
+		fprintf(stderr, "dsm_region_create() needs dsm_init() and "
+			"makes one region\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Node 0 picks the address and shape; the others follow */
+	if (config.self == 0) {
+		rgn.len = len;
+		rgn.granule = granule ? granule : sysconf(_SC_PAGE_SIZE);
+		rgn.backing = backing;
+	} else {
+		hint = msi_recv_region(peer[0], &rgn);
+	}
+	region_create(&rgn, hint);
+	if (config.profile != NULL)
+		prof_init(config.self, rgn.len / rgn.granule, rgn.granule);
+	if (config.record != NULL)
+		trace_record_start(config.self, rgn.len / rgn.granule,
+				   rgn.granule);
+	if (config.self == 0)
+		for (int i = 1; i < config.nnodes; i++)
+			msi_send_region(peer[i], &rgn);
+
+	msi_init(config.self, config.nnodes, &rgn, config.transport);
+	for (int i = 0; i < config.nnodes; i++)
+		if (i != config.self)
+			msi_add_peer(i, peer[i]);
+	fault_set_trace(config.trace);
+	if (config.faultlog != NULL) {
+		snprintf(path, sizeof(path), "%s.%d", config.faultlog,
+			 config.self);
+		flog_open(path, config.self, &rgn, config.handlers);
+	}
+	fault_start(&rgn, config.handlers, config.prefetch);
+	if (config.stats != NULL)
+		lat_export(config.stats, config.stats_ms);
+	alloc_init(&rgn, config.self);
+	return rgn.base;
+}
+
+void
+dsm_shutdown(void)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	if (!joined)
+		return;
+	if (rgn.base == NULL) {
+		for (int i = 0; i < config.nnodes; i++)
+			if (i != config.self)
+				close(peer[i]);
+		joined = 0;
+		return;
+	}
+
+	/* The barrier settles what the nodes have written; after the one
+	 * in msi_shutdown(), everybody expects the others to hang up. The
+	 * region stays mapped and the runtime's threads idle until the
+	 * process exits.
+	 */
+	dsm_barrier();
+	msi_shutdown();
+	joined = 0;
+
+	if (config.profile != NULL) {
+		snprintf(path, sizeof(path), "%s.%d", config.profile,
+			 config.self);
+		f = fopen(path, "w");
+		if (f == NULL)
+			errExit(path);
+		prof_write(f);
+		fclose(f);
+	}
+	if (config.record != NULL) {
+		snprintf(path, sizeof(path), "%s.%d", config.record,
+			 config.self);
+		f = fopen(path, "w");
+		if (f == NULL)
+			errExit(path);
+		trace_write(f);
+		fclose(f);
+	}
+}
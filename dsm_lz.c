@@ -0,0 +1,209 @@
+/* dsm_lz.c
+
+   A small LZ77 compressor for page payloads, in the manner of LZ4. The
+   output is a list of sequences: a token byte whose high nibble is the
+   number of literals and whose low nibble is the match length less 4,
+   either nibble at 15 continued by bytes of 255 and a final smaller one;
+   the literals; and a 16-bit little-endian offset back to the match. The
+   last sequence has literals only. It is tuned for speed, not ratio: one
+   probe of a hash table of recent positions, and a longer stride through
+   data that does not compress.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dsm.h"
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define SKIP_SHIFT 6		/* Stride grows by one every 64 misses */
+
+static uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Length of the common prefix of a and b, at most max bytes, compared a
+ * word at a time. Assumes little-endian words.
+ */
+static size_t
+match_len(const uint8_t *a, const uint8_t *b, size_t max)
+{
+	uint64_t x, y;
+	size_t n = 0;
+
+	for (; n + sizeof(x) <= max; n += sizeof(x)) {
+		memcpy(&x, a + n, sizeof(x));
+		memcpy(&y, b + n, sizeof(y));
+		if (x != y)
+			return n + __builtin_ctzll(x ^ y) / 8;
+	}
+	while (n < max && a[n] == b[n])
+		n++;
+	return n;
+}
+
+static uint8_t *
+put_len(uint8_t *op, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+/* Append a sequence of nlit literals at lit and a match of mlen bytes at
+ * off back, or literals only if mlen is 0. NULL if it does not fit.
+ */
+static uint8_t *
+put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+	size_t off, size_t mlen)
+{
+	size_t ml = mlen ? mlen - MIN_MATCH : 0;
+	uint8_t *token;
+
+	if ((size_t) (oend - op) < 1 + nlit / 255 + 1 + nlit + 2 + ml / 255 + 1)
+		return NULL;
+
+	token = op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15)
+		op = put_len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen == 0)
+		return op;
+
+	*op++ = off & 0xff;
+	*op++ = off >> 8;
+	*token |= ml < 15 ? ml : 15;
+	if (ml >= 15)
+		op = put_len(op, ml - 15);
+	return op;
+}
+
+ssize_t
+lz_compress(const char *src, size_t len, char *dst, size_t max)
+{
+	uint32_t table[1 << HASH_BITS];
+	const uint8_t *base = (const uint8_t *) src;
+	const uint8_t *ip = base, *anchor = base, *end = base + len;
+	const uint8_t *ref;
+	uint8_t *op = (uint8_t *) dst, *oend = op + max;
+	uint32_t seq, h;
+	size_t mlen;
+
+	memset(table, 0, sizeof(table));
+	while (len >= MIN_MATCH && ip <= end - MIN_MATCH) {
+		seq = read32(ip);
+		h = (seq * 2654435761U) >> (32 - HASH_BITS);
+		ref = base + table[h];
+		table[h] = ip - base;
+
+		if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+			ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+			continue;
+		}
+
+		mlen = MIN_MATCH + match_len(ref + MIN_MATCH, ip + MIN_MATCH,
+					     end - ip - MIN_MATCH);
+		op = put_seq(op, oend, anchor, ip - anchor, ip - ref, mlen);
+		if (op == NULL)
+			return -1;
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+	if (op == NULL)
+		return -1;
+	return op - (uint8_t *) dst;
+}
+
+/* Read a length continued in bytes of 255; -1 past the end of the input.
+ */
+static ssize_t
+get_len(const uint8_t **ipp, const uint8_t *iend, size_t n)
+{
+	const uint8_t *ip = *ipp;
+	uint8_t b;
+
+	do {
+		if (ip == iend)
+			return -1;
+		b = *ip++;
+		n += b;
+	} while (b == 255);
+	*ipp = ip;
+	return n;
+}
+
+ssize_t
+lz_decompress(const char *src, size_t slen, char *dst, size_t max)
+{
+	const uint8_t *ip = (const uint8_t *) src, *iend = ip + slen;
+	uint8_t *op = (uint8_t *) dst, *oend = op + max, *from;
+	ssize_t nlit, mlen, n;
+	size_t off;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		nlit = token >> 4;
+		if (nlit == 15 && (nlit = get_len(&ip, iend, 15)) == -1)
+			return -1;
+		if (iend - ip < nlit || oend - op < nlit)
+			return -1;
+		/* Short copies are the common case; a fixed size lets the
+		 * compiler inline them.
+		 */
+		if (nlit <= 16 && iend - ip >= 16 && oend - op >= 16)
+			memcpy(op, ip, 16);
+		else
+			memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15 && (mlen = get_len(&ip, iend, 15)) == -1)
+			return -1;
+		mlen += MIN_MATCH;
+		if (off == 0 || off > (size_t) (op - (uint8_t *) dst) ||
+		    oend - op < mlen)
+			return -1;
+
+		/* A match may overlap what it produces, repeating the last off
+		 * bytes. What has been produced repeats them too, so every
+		 * copy can take twice as much as the one before.
+		 */
+		from = op - off;
+		if (off >= 16 && mlen <= 16 && oend - op >= 16) {
+			memcpy(op, from, 16);
+			op += mlen;
+			continue;
+		}
+		while (mlen > 0) {
+			n = op - from < mlen ? op - from : mlen;
+			memcpy(op, from, n);
+			op += n;
+			mlen -= n;
+		}
+	}
+	return op - (uint8_t *) dst;
+}
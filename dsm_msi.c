@@ -0,0 +1,2610 @@
+/* dsm_msi.c
+
+   Page-granule MSI coherence between DSM nodes. A page here is one
+   coherence granule of the region, which may span several base pages or
+   be a huge page.
+
+   Every page has a home node, picked by hashing the page number, that
+   keeps its directory entry: the global state, the owner of a Modified
+   page and the set of nodes holding a Shared copy. Misses go to the home,
+   which forwards them to a node that holds the data. The home handles one
+   request per page at a time; the requester sends MSG_UNBLOCK once the
+   page is installed and the next queued request may go.
+
+   A page that one node after another reads and then writes is migratory.
+   The home notices when a Shared page with two copies is upgraded by the
+   node that did not write it last, and from then on answers a read miss
+   on the page with the Modified copy, so that each handoff takes one
+   transfer instead of a miss and an upgrade. The new owner gets the page
+   write-protected and lifts the protection itself at its first write. A
+   node that gives such a copy up without having written it says so, and
+   the page goes back to plain MSI.
+
+   The hashed home is only where a page starts out. The home counts the
+   requests for each page by node, and once another node has asked
+   MOVE_AFTER times more than the home itself, the directory entry moves
+   there, so that the node that misses most misses at home. The old home
+   keeps a forwarding pointer and passes on whatever still reaches it,
+   telling the requester where the page went. Every move bumps the page's
+   home epoch, and a node only follows news newer than what it knows, so
+   the pointers always lead to the current home.
+
+   In lazy release consistency mode there is no directory. The home keeps
+   a master copy of each page instead. Nodes fetch pages from it and write
+   their local copies freely, with a twin taken at the first write. At
+   dsm_release() every page written since the last release goes back to
+   its home as a diff against its twin, and the release is logged as an
+   interval listing those pages. At dsm_acquire() a node collects the
+   write notices, the pages of the intervals it has not yet seen, from
+   every other node, and drops its copies of those pages.
+
+   Page contents travel to a peer over the data lane of their page
+   number, a connection of their own with a thread at each end, so that a
+   large page in transit does not hold up requests, invalidations and
+   lock messages, which take the main connection. So do the forwarded
+   requests that make a holder copy a page out, so that the copying is
+   done by the lane's thread and not the reactor. Replies are matched to
+   requests by ID, and a home serves one request per page at a time, so
+   the protocol does not mind messages on different connections
+   overtaking each other. MSG_FETCH goes on the lane of its page too, so
+   that it cannot overtake the MSG_FLUSH that a node sent before dropping
+   the page.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <linux/userfaultfd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "dsm.h"
+
+#define NSTRIPES 64		/* Locks protecting the page table */
+#define MAX_IOV 64		/* Messages written to a peer at once */
+#define RX_SPARE 65536		/* Receive buffer beyond one full message */
+#define MOVE_AFTER 16		/* Requests beyond the home's that move it */
+#define COUNT_AGE 256		/* Request counts are halved at this many */
+
+enum msi_type {
+	MSG_READ_REQ,		/* requester -> home: read miss */
+	MSG_WRITE_REQ,		/* requester -> home: write miss or upgrade */
+	MSG_FWD_READ,		/* home -> holder: send a copy, keep Shared */
+	MSG_FWD_WRITE,		/* home -> holder: send a copy, invalidate */
+	MSG_INV,		/* home -> sharer: invalidate */
+	MSG_INV_ACK,		/* sharer -> home */
+	MSG_DATA,		/* holder -> requester: page contents follow */
+	MSG_DIFF,		/* holder -> requester: changes to its old copy */
+	MSG_ZERO,		/* holder -> requester: the page is all zero */
+	MSG_GRANT,		/* home -> requester: upgrade, no data */
+	MSG_UNBLOCK,		/* requester -> home: page installed */
+	MSG_REGION,		/* node 0 -> others: struct msi_region */
+	MSG_HOME,		/* old home -> new home: struct msi_home */
+	MSG_MOVED,		/* old home -> requester: home is base, epoch version */
+
+	/* Lazy release consistency */
+	MSG_FETCH,		/* requester -> home: send the master copy */
+	MSG_FLUSH,		/* writer -> home: diff to apply to it */
+	MSG_FLUSH_ACK,		/* home -> writer */
+	MSG_ACQUIRE,		/* acquirer -> all: notices after interval base */
+	MSG_NOTICE,		/* reply: page numbers, up to interval version */
+
+	/* Locks and barriers; page is the lock number */
+	MSG_LOCK_REQ,		/* requester -> manager: seen intervals follow */
+	MSG_LOCK_FWD,		/* manager -> last requester: pass it on after */
+	MSG_LOCK_GRANT,		/* holder -> next: its intervals, then notices */
+	MSG_BARRIER,		/* node -> node 0: arrived at interval version */
+	MSG_BARRIER_GO,		/* node 0 -> all: interval of every node */
+};
+
+#define MSI_MAGIC 0x4d53	/* "MS" */
+#define MSI_HAVE_OLD 0x1	/* The requester keeps a copy of version base */
+#define MSI_LZ 0x2		/* The page is compressed with lz_compress() */
+#define MSI_WHOLE 0x4		/* MSG_FLUSH carries the page, not a diff */
+#define MSI_ALL 0x8		/* MSG_NOTICE: too many pages, drop them all */
+#define MSI_EXCL 0x10		/* A read miss is answered with the Modified copy */
+#define MSI_CLEAN 0x20		/* ... which its holder did not write */
+
+/* Header of every message on the wire, followed by len bytes of payload.
+ * Each miss gets an ID from its requester that all messages serving it
+ * carry, so a reply is matched to its request whatever order replies
+ * arrive in. Nodes are assumed to share byte order and word size.
+ *
+ * Every write permission handed out starts a new version of the page.
+ * Replies say which version they carry, and a requester that kept an
+ * old copy says which one, so that the holder can send a diff instead.
+ */
+struct msi_msg {
+	uint16_t magic;		/* MSI_MAGIC, catches a stream out of step */
+	uint8_t type;
+	uint8_t flags;
+	uint16_t src;		/* Node that sent the message */
+	uint16_t requester;	/* Node whose miss is being served */
+	uint32_t id;		/* Request ID, unique per requester */
+	uint32_t count;		/* Granules from page on, always 1 so far */
+	uint32_t version;	/* Version of the page contents sent */
+	uint32_t base;		/* Version of the requester's old copy */
+	uint64_t page;		/* Page number within the region */
+	uint64_t len;		/* Payload bytes */
+};
+
+/* Payload of MSG_REGION.
+ */
+struct msi_region {
+	uint64_t base;
+	uint64_t len;
+	uint64_t granule;
+	uint32_t backing;
+	uint32_t lrc;		/* Lazy release consistency */
+};
+
+/* Payload of MSG_HOME, the directory entry of a page changing homes.
+ */
+struct msi_home {
+	uint32_t epoch;		/* Of the new home */
+	uint32_t dir_state;
+	int32_t owner;
+	int32_t last_writer;
+	uint64_t sharers;
+	uint32_t migratory;
+	uint32_t pad;
+};
+
+/* A request that waits at the home until the page is no longer busy.
+ */
+struct msi_pending {
+	struct msi_msg msg;
+	struct msi_pending *next;
+};
+
+struct msi_page {
+	/* Local copy */
+	int state;
+	int inflight;		/* A request for the page is outstanding */
+	int write;		/* ... for write permission */
+	uint32_t id;		/* ... with this ID */
+	struct msi_wait *wait;
+	uint32_t version;	/* Version of the local copy */
+	char *twin;		/* Copy of an earlier version, or NULL */
+	uint32_t twin_version;
+	int excl;		/* The reply made a read miss Modified */
+	int clean;		/* Modified after a read miss, not yet written */
+	int was_clean;		/* The holder gave it up unwritten, tell home */
+	int home;		/* Home node as far as we know, or ourselves */
+	uint32_t home_epoch;	/* ... as of this move of the home */
+
+	/* Directory entry, only used on the page's home node */
+	char *master;		/* LRC: the page, or NULL while it is zero */
+	int dir_state;
+	int owner;
+	unsigned long sharers;
+	int last_writer;	/* Node last given write permission, or -1 */
+	int migratory;		/* Read misses take the Modified copy */
+	int move_to;		/* Node to move the home to once idle, or -1 */
+	int busy;		/* Serving a request, others are queued */
+	int busy_node;		/* ... from this node */
+	uint32_t busy_id;	/* ... with this ID */
+	int acks;		/* Invalidation acks still expected */
+	int after_node;		/* Message to send once all acks are in */
+	struct msi_msg after;
+	struct msi_pending *head, *tail;
+};
+
+/* Page-sized buffers for what a thread sends while handling a message;
+ * every thread that dispatches has its own.
+ */
+struct msi_bufs {
+	char *copy;		/* Outgoing page copies */
+	char *diff;		/* Outgoing diffs, or NULL without diffs */
+	char *lz;		/* Outgoing compressed pages, or NULL */
+};
+
+/* Messages produced while a stripe lock is held; they are sent after the
+ * lock is dropped so that copying the data does not hold up other pages.
+ */
+struct outbox {
+	int n;
+	struct {
+		int node;
+		struct msi_msg msg;
+		const char *data;
+	} m[MAX_NODES + 1];
+	struct msi_home home;	/* Payload of a MSG_HOME among them */
+	struct msi_bufs *bufs;	/* Of the thread filling it */
+};
+
+struct mbox_item {
+	struct msi_msg msg;
+	char *data;
+	struct mbox_item *next;
+};
+
+/* Messages in the order they were sent, with their own copy of the data.
+ */
+struct mbox {
+	struct mbox_item *head, *tail;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t idle;	/* Signalled when all taken has been written */
+	int taken;		/* Items taken off and still being written */
+	int efd;		/* eventfd the reactor waits on, or -1 */
+};
+
+/* A release: the pages this node wrote in the interval before it.
+ */
+struct lrc_interval {
+	uint32_t id;
+	unsigned long n;
+	unsigned long *pages;
+	struct lrc_interval *next;
+};
+
+/* Page numbers, growing as needed.
+ */
+struct page_list {
+	unsigned long n, size;
+	unsigned long *pages;
+};
+
+/* A lock as this node sees it. Requests queue up behind the node that
+ * asked last, which the manager remembers; the lock then goes straight
+ * from each holder to the next without the manager.
+ */
+struct lock_state {
+	pthread_mutex_t local;	/* Threads of this node take turns */
+	int tail;		/* Manager: node that asked last */
+	int token;		/* The lock is ours to hand out */
+	int held;		/* ... and a thread of ours holds it */
+	int next;		/* Node to pass it to, or -1 */
+	uint32_t *next_seen;	/* ... and the intervals that node has seen */
+	char *grant;		/* Payload of the grant that brought it here */
+	size_t grant_len;
+	int grant_src;
+	int grant_all;
+};
+
+/* Bytes received from a peer that do not make up a whole message yet.
+ */
+struct rx {
+	char *buf;
+	size_t have;
+};
+
+/* A data lane to a peer, with a sender thread writing mbox to fd and a
+ * receiver thread dispatching what comes in on it.
+ */
+struct lane {
+	int node;
+	int fd;			/* -1 unless the lane is up */
+	struct mbox mbox;
+	struct rx rx;
+	struct msi_bufs bufs;
+};
+
+static int self_id;
+static uint32_t next_id;	/* Request IDs handed out so far */
+static int num_nodes;
+static int net_transport;
+static struct dsm_region *rgn;
+static char *region;
+static unsigned long num_pages;
+static unsigned long pg_size;
+static long region_uffd;
+
+static struct msi_page *pages;
+static uint16_t *asked;		/* Home: requests for each page by each node */
+static pthread_mutex_t stripe_lock[NSTRIPES];
+static pthread_cond_t stripe_cond[NSTRIPES];
+static char *zero_page;
+
+static int peer_fd[MAX_NODES];
+static struct shm_link *peer_link[MAX_NODES];	/* Or NULL for the socket */
+static struct rx peer_rx[MAX_NODES];
+static int tx_busy[MAX_NODES];	/* io_uring: a chain of sends is in flight */
+static struct mbox_item *tx_items[MAX_NODES];	/* ... carrying these */
+static struct lane lanes[MAX_NODES][DSM_DATA_LANES];
+static size_t rx_size;
+static struct msi_bufs reactor_bufs;
+static int diff_on;
+static int lz_on;
+static int migratory_on = 1;
+static int moves_on = 1;	/* Homes follow the nodes that use them */
+static int lanes_on = 1;
+static int closing;		/* Peers may hang up, see msi_shutdown() */
+/* Added to atomically, by every thread that sends or dispatches.
+ */
+static struct msi_stats stats;
+
+/* Lazy release consistency. lrc_lock nests inside the stripe locks.
+ * Acquires and releases take turns under sync_lock.
+ */
+static int lrc_on;
+static pthread_mutex_t lrc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lrc_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct page_list dirty;	/* Pages written since the last release */
+static struct page_list flushed;	/* ... and already sent home */
+static struct lrc_interval *log_head, *log_tail;
+static uint32_t interval;	/* Intervals this node has closed */
+static uint32_t seen[MAX_NODES];	/* Intervals of each node we know of */
+static uint32_t known[MAX_NODES];	/* Our intervals each node knows of */
+static int flush_acks;		/* Flushes not yet acknowledged */
+static int notices_due;		/* Nodes yet to answer an acquire */
+static int notice_all;		/* ... and one said to drop everything */
+static struct page_list noticed;	/* Pages they named */
+
+/* Locks and the barrier, all under sync_state_lock.
+ */
+static struct lock_state locks[DSM_LOCKS];
+static pthread_mutex_t sync_state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static int arrived;		/* Node 0: nodes at the barrier */
+static uint32_t arrived_at[MAX_NODES];	/* ... and their intervals */
+static unsigned long barrier_gen;	/* Barriers passed */
+static uint32_t barrier_at[MAX_NODES];	/* Intervals at the last one */
+
+/* Messages on their way to each node. The ones to ourselves are
+ * dispatched by the reactor, the others are written to the peer's socket
+ * by a sender thread, so that a full socket never stalls the thread that
+ * sent.
+ */
+static struct mbox mbox[MAX_NODES];
+
+/* Spread the directory over all nodes. Hashing keeps regular strides
+ * from landing on the same home.
+ */
+static int
+home_of(unsigned long pgno)
+{
+	return ((pgno * 0x9e3779b97f4a7c15UL) >> 32) % num_nodes;
+}
+
+static void
+lock_page(unsigned long pgno)
+{
+	pthread_mutex_lock(&stripe_lock[pgno % NSTRIPES]);
+}
+
+static void
+unlock_page(unsigned long pgno)
+{
+	pthread_mutex_unlock(&stripe_lock[pgno % NSTRIPES]);
+}
+
+static void
+mbox_put(struct mbox *mb, struct msi_msg *msg, const char *data)
+{
+	struct mbox_item *it;
+
+	it = malloc(sizeof(*it));
+	if (it == NULL)
+		errExit("malloc");
+	it->msg = *msg;
+	it->data = NULL;
+	it->next = NULL;
+	if (msg->len > 0) {
+		it->data = malloc(msg->len);
+		if (it->data == NULL)
+			errExit("malloc");
+		memcpy(it->data, data, msg->len);
+	}
+
+	pthread_mutex_lock(&mb->lock);
+	if (mb->tail)
+		mb->tail->next = it;
+	else
+		mb->head = it;
+	mb->tail = it;
+	pthread_cond_signal(&mb->cond);
+	pthread_mutex_unlock(&mb->lock);
+
+	if (mb->efd != -1 && eventfd_write(mb->efd, 1) == -1)
+		errExit("eventfd_write");
+}
+
+/* Write a message for a node on this host straight into the ring of l,
+ * so that its data is copied once and not first into a mailbox item.
+ * The ring is ours only while the sender thread has nothing to write,
+ * and a full ring is left to the sender thread, so that the caller does
+ * not wait for the peer. Returns whether the message went.
+ */
+static int
+ring_put(struct mbox *mb, struct shm_link *l, struct msi_msg *msg,
+	 const char *data)
+{
+	int sent = 0;
+
+	pthread_mutex_lock(&mb->lock);
+	if (mb->head == NULL && !mb->taken &&
+	    shm_try_put(l, msg, sizeof(*msg), data, msg->len)) {
+		shm_push(l);
+		sent = 1;
+	}
+	pthread_mutex_unlock(&mb->lock);
+	return sent;
+}
+
+/* Take all queued messages, oldest first, waiting for one if wait is set.
+ */
+static struct mbox_item *
+mbox_take(struct mbox *mb, int wait)
+{
+	struct mbox_item *it;
+
+	pthread_mutex_lock(&mb->lock);
+	while (wait && mb->head == NULL)
+		pthread_cond_wait(&mb->cond, &mb->lock);
+	it = mb->head;
+	mb->head = mb->tail = NULL;
+	mb->taken = it != NULL;
+	pthread_mutex_unlock(&mb->lock);
+	return it;
+}
+
+/* Done writing what mbox_take() handed out.
+ */
+static void
+mbox_done(struct mbox *mb)
+{
+	pthread_mutex_lock(&mb->lock);
+	mb->taken = 0;
+	pthread_cond_broadcast(&mb->idle);
+	pthread_mutex_unlock(&mb->lock);
+}
+
+static void
+free_items(struct mbox_item *it)
+{
+	struct mbox_item *next;
+
+	for (; it; it = next) {
+		next = it->next;
+		free(it->data);
+		free(it);
+	}
+}
+
+/* Point iov at the messages starting at *itp, as many as fit in MAX_IOV
+ * entries, and advance *itp past them.
+ */
+static int
+fill_iov(struct iovec *iov, struct mbox_item **itp)
+{
+	struct mbox_item *it;
+	int cnt = 0;
+
+	for (it = *itp; it && cnt + 2 <= MAX_IOV; it = it->next) {
+		iov[cnt].iov_base = &it->msg;
+		iov[cnt++].iov_len = sizeof(it->msg);
+		if (it->data) {
+			iov[cnt].iov_base = it->data;
+			iov[cnt++].iov_len = it->msg.len;
+		}
+	}
+	*itp = it;
+	return cnt;
+}
+
+static void uring_tx(int node);
+
+static void
+uring_tx_done(void *arg)
+{
+	int node = (long) arg;
+
+	free_items(tx_items[node]);
+	pthread_mutex_lock(&mbox[node].lock);
+	tx_busy[node] = 0;
+	pthread_cond_broadcast(&mbox[node].idle);
+	pthread_mutex_unlock(&mbox[node].lock);
+	uring_tx(node);
+}
+
+/* Start sending what is queued for node, unless a chain to it is still
+ * in flight; its completion comes back here.
+ */
+static void
+uring_tx(int node)
+{
+	struct mbox *mb = &mbox[node];
+	struct iovec iov[MAX_IOV];
+	struct mbox_item *it, *last, *rest;
+	int cnt;
+
+	pthread_mutex_lock(&mb->lock);
+	if (tx_busy[node] || mb->head == NULL) {
+		pthread_mutex_unlock(&mb->lock);
+		return;
+	}
+	it = rest = mb->head;
+	cnt = fill_iov(iov, &rest);
+	for (last = it; last->next != rest; last = last->next)
+		;
+	last->next = NULL;
+	mb->head = rest;
+	if (rest == NULL)
+		mb->tail = NULL;
+	tx_busy[node] = 1;
+	tx_items[node] = it;
+	pthread_mutex_unlock(&mb->lock);
+
+	uring_send(peer_fd[node], iov, cnt, uring_tx_done, (void *) (long) node);
+}
+
+/* Whether a message of type goes on a data lane.
+ */
+static int
+on_lane(int type)
+{
+	return type == MSG_FWD_READ || type == MSG_FWD_WRITE ||
+	       type == MSG_DATA || type == MSG_DIFF || type == MSG_FLUSH ||
+	       type == MSG_FETCH;
+}
+
+static void
+send_msg(int node, struct msi_msg *msg, const char *data)
+{
+	struct lane *ln = NULL;
+
+	msg->magic = MSI_MAGIC;
+	msg->src = self_id;
+	msg->count = 1;
+	__atomic_add_fetch(&stats.msgs, 1, __ATOMIC_RELAXED);
+	if (node != self_id)
+		__atomic_add_fetch(&stats.wire, sizeof(*msg) + msg->len,
+				   __ATOMIC_RELAXED);
+	if (lanes_on && node != self_id && on_lane(msg->type) &&
+	    lanes[node][0].fd != -1)
+		ln = &lanes[node][msg->page % DSM_DATA_LANES];
+	if (ln) {
+		mbox_put(&ln->mbox, msg, data);
+		return;
+	}
+	if (node != self_id && peer_link[node] != NULL &&
+	    ring_put(&mbox[node], peer_link[node], msg, data))
+		return;
+	mbox_put(&mbox[node], msg, data);
+	if (net_transport == DSM_URING && node != self_id &&
+	    peer_link[node] == NULL)
+		uring_tx(node);
+}
+
+/* Queue a message about the request req, which is being served.
+ */
+static void
+outbox_add(struct outbox *ob, int node, int type, struct msi_msg *req,
+	   const char *data)
+{
+	ob->m[ob->n].node = node;
+	ob->m[ob->n].msg = *req;
+	ob->m[ob->n].msg.type = type;
+	ob->m[ob->n].msg.len = 0;
+	ob->m[ob->n].data = data;
+	ob->n++;
+}
+
+static void
+stat_add(unsigned long *counter, unsigned long n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static unsigned long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Queue version version of a page for the requester of req: len bytes at
+ * data, the page itself for MSG_DATA, a diff against the requester's old
+ * copy for MSG_DIFF or nothing for MSG_ZERO.
+ */
+static void
+outbox_page(struct outbox *ob, int type, struct msi_msg *req,
+	    const char *data, size_t len, uint32_t version)
+{
+	struct msi_msg *msg;
+	unsigned long t;
+	ssize_t n;
+
+	outbox_add(ob, req->requester, type, req, data);
+	msg = &ob->m[ob->n - 1].msg;
+	if (type != MSG_DIFF)
+		msg->flags = 0;
+	msg->version = version;
+	msg->len = len;
+
+	/* Compression has to save an eighth of the page to pay for the
+	 * time it takes at both ends.
+	 */
+	if (lz_on && type == MSG_DATA && req->requester != self_id &&
+	    ob->bufs->lz) {
+		t = now_ns();
+		n = lz_compress(data, len, ob->bufs->lz, len - len / 8);
+		stat_add(&stats.lz_ns, now_ns() - t);
+		stat_add(&stats.lz_tried, 1);
+		if (n >= 0) {
+			ob->m[ob->n - 1].data = ob->bufs->lz;
+			msg->flags |= MSI_LZ;
+			msg->len = n;
+			stat_add(&stats.lz_sent, 1);
+			stat_add(&stats.lz_in, len);
+			stat_add(&stats.lz_out, n);
+		}
+	}
+
+	stat_add(type == MSG_DATA ? &stats.full :
+		 type == MSG_DIFF ? &stats.diffs : &stats.zeros, 1);
+	stat_add(&stats.bytes, msg->len);
+}
+
+static void
+outbox_flush(struct outbox *ob)
+{
+	for (int i = 0; i < ob->n; i++)
+		send_msg(ob->m[i].node, &ob->m[i].msg, ob->m[i].data);
+	ob->n = 0;
+}
+
+/* Write-protect a page that goes from Modified to Shared, so the next
+ * local write traps and asks for the page again.
+ */
+static void
+protect_page(unsigned long pgno)
+{
+	struct uffdio_writeprotect wp;
+
+	wp.range.start = (unsigned long) region + pgno * pg_size;
+	wp.range.len = pg_size;
+	wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+	if (ioctl(region_uffd, UFFDIO_WRITEPROTECT, &wp) == -1)
+		errExit("ioctl-UFFDIO_WRITEPROTECT");
+}
+
+static void
+unprotect_page(unsigned long pgno)
+{
+	struct uffdio_writeprotect wp;
+
+	wp.range.start = (unsigned long) region + pgno * pg_size;
+	wp.range.len = pg_size;
+	wp.mode = UFFDIO_WRITEPROTECT_MODE_DONTWAKE;
+	if (ioctl(region_uffd, UFFDIO_WRITEPROTECT, &wp) == -1)
+		errExit("ioctl-UFFDIO_WRITEPROTECT");
+}
+
+/* Keep the len bytes at data as the page's twin, version version.
+ */
+static void
+save_twin(struct msi_page *pg, const char *data, uint32_t version)
+{
+	if (pg->twin == NULL) {
+		pg->twin = malloc(pg_size);
+		if (pg->twin == NULL)
+			errExit("malloc");
+	}
+	memcpy(pg->twin, data, pg_size);
+	pg->twin_version = version;
+}
+
+/* Give up the local copy, whose contents are at data. In diff mode they
+ * stay behind as the twin so the next miss can ask for the changes only.
+ */
+static void
+drop_page(unsigned long pgno, const char *data)
+{
+	if (diff_on)
+		save_twin(&pages[pgno], data, pages[pgno].version);
+	region_drop(rgn, pgno * pg_size, pg_size);
+}
+
+/* Any node holding a Shared copy can supply the data; prefer ourselves.
+ */
+static int
+pick_sharer(unsigned long sharers)
+{
+	if (sharers & (1UL << self_id))
+		return self_id;
+	return __builtin_ctzl(sharers);
+}
+
+static void
+list_add(struct page_list *l, unsigned long pgno)
+{
+	if (l->n == l->size) {
+		l->size = l->size ? 2 * l->size : 64;
+		l->pages = realloc(l->pages, l->size * sizeof(*l->pages));
+		if (l->pages == NULL)
+			errExit("realloc");
+	}
+	l->pages[l->n++] = pgno;
+}
+
+/* Move the pages of from to the end of to, leaving from empty.
+ */
+static void
+list_move(struct page_list *to, struct page_list *from)
+{
+	for (unsigned long i = 0; i < from->n; i++)
+		list_add(to, from->pages[i]);
+	from->n = 0;
+}
+
+/* Note that the page is written in the current interval. Called with
+ * its stripe lock held.
+ */
+static void
+mark_dirty(unsigned long pgno)
+{
+	pthread_mutex_lock(&lrc_lock);
+	list_add(&dirty, pgno);
+	pthread_mutex_unlock(&lrc_lock);
+}
+
+/* Wake whoever waits for the reply to the page's request. Called with the
+ * stripe lock held.
+ */
+static void
+wake_waiter(unsigned long pgno)
+{
+	struct msi_page *pg = &pages[pgno];
+
+	pg->wait->done = 1;
+	pthread_cond_broadcast(&stripe_cond[pgno % NSTRIPES]);
+	if (pg->wait->notify) {
+		pthread_mutex_lock(&pg->wait->notify->lock);
+		pg->wait->notify->count++;
+		pthread_cond_signal(&pg->wait->notify->cond);
+		pthread_mutex_unlock(&pg->wait->notify->lock);
+	}
+}
+
+/* Count a request of node r at the home, and decide whether the page
+ * should move there. Old requests count less and less, so that the home
+ * follows a change of the node using the page.
+ */
+static void
+count_request(struct msi_page *pg, int r)
+{
+	uint16_t *n = &asked[(pg - pages) * num_nodes];
+
+	if (++n[r] == COUNT_AGE)
+		for (int k = 0; k < num_nodes; k++)
+			n[k] /= 2;
+	if (moves_on && r != self_id &&
+	    n[r] >= n[self_id] + MOVE_AFTER)
+		pg->move_to = r;
+}
+
+/* Start serving req at the home. Called with the page's stripe lock held
+ * and the page not busy.
+ */
+static void
+home_serve(struct msi_page *pg, struct msi_msg *req, struct outbox *ob)
+{
+	int r = req->requester;
+	unsigned long rbit = 1UL << r;
+	unsigned long others;
+	int supplier;
+
+	pg->busy = 1;
+	pg->busy_node = r;
+	pg->busy_id = req->id;
+	pg->acks = 0;
+
+	count_request(pg, r);
+
+	/* The read is followed by a write; take the page over whole */
+	if (req->type == MSG_READ_REQ && pg->migratory &&
+	    pg->dir_state == MSI_MODIFIED && pg->owner != r) {
+		outbox_add(ob, pg->owner, MSG_FWD_WRITE, req, NULL);
+		ob->m[ob->n - 1].msg.flags |= MSI_EXCL;
+		stat_add(&stats.mig_grants, 1);
+		pg->owner = r;
+		pg->last_writer = r;
+		pg->sharers = rbit;
+		return;
+	}
+
+	if (req->type == MSG_READ_REQ) {
+		switch (pg->dir_state) {
+		case MSI_INVALID:
+			outbox_page(ob, MSG_ZERO, req, NULL, 0, 0);
+			pg->sharers = 0;
+			break;
+		case MSI_SHARED:
+			outbox_add(ob, pick_sharer(pg->sharers), MSG_FWD_READ,
+				   req, NULL);
+			break;
+		case MSI_MODIFIED:
+			outbox_add(ob, pg->owner, MSG_FWD_READ, req, NULL);
+			pg->sharers = 1UL << pg->owner;
+			break;
+		}
+		pg->dir_state = MSI_SHARED;
+		pg->sharers |= rbit;
+		return;
+	}
+
+	switch (pg->dir_state) {
+	case MSI_INVALID:
+		outbox_page(ob, MSG_ZERO, req, NULL, 0, 0);
+		break;
+	case MSI_MODIFIED:
+		if (pg->owner == r)
+			outbox_add(ob, r, MSG_GRANT, req, NULL);
+		else
+			outbox_add(ob, pg->owner, MSG_FWD_WRITE, req, NULL);
+		break;
+	case MSI_SHARED:
+		/* A copy read by the last writer and then upgraded by the
+		 * other node that read it has migrated.
+		 */
+		if (migratory_on && !pg->migratory && pg->last_writer != -1 &&
+		    pg->last_writer != r &&
+		    pg->sharers == (rbit | 1UL << pg->last_writer)) {
+			pg->migratory = 1;
+			stat_add(&stats.mig_found, 1);
+		}
+
+		/* An upgrading sharer already has the data; otherwise one
+		 * sharer hands it over once everybody else has dropped theirs.
+		 */
+		others = pg->sharers & ~rbit;
+		pg->after = *req;
+		if (pg->sharers & rbit) {
+			pg->after_node = r;
+			pg->after.type = MSG_GRANT;
+		} else {
+			supplier = pick_sharer(pg->sharers);
+			others &= ~(1UL << supplier);
+			pg->after_node = supplier;
+			pg->after.type = MSG_FWD_WRITE;
+		}
+
+		for (int n = 0; n < num_nodes; n++) {
+			if (others & (1UL << n)) {
+				outbox_add(ob, n, MSG_INV, req, NULL);
+				pg->acks++;
+			}
+		}
+		if (pg->acks == 0)
+			outbox_add(ob, pg->after_node, pg->after.type,
+				   &pg->after, NULL);
+		break;
+	}
+	pg->dir_state = MSI_MODIFIED;
+	pg->owner = r;
+	pg->last_writer = r;
+	pg->sharers = rbit;
+}
+
+/* Pass a message for the directory on to where the page's home went,
+ * and tell the requester. Called with the stripe lock held.
+ */
+static void
+forward_home(struct msi_page *pg, struct msi_msg *msg, struct outbox *ob)
+{
+	struct msi_msg *moved;
+
+	outbox_add(ob, pg->home, msg->type, msg, NULL);
+	stat_add(&stats.home_fwds, 1);
+	if (msg->type == MSG_UNBLOCK || msg->requester == self_id ||
+	    msg->requester == pg->home)
+		return;
+	outbox_add(ob, msg->requester, MSG_MOVED, msg, NULL);
+	moved = &ob->m[ob->n - 1].msg;
+	moved->flags = 0;
+	moved->base = pg->home;
+	moved->version = pg->home_epoch;
+}
+
+/* Hand the directory entry over to the node that asks for the page most
+ * and leave a forwarding pointer behind. Called with the stripe lock held
+ * and the page idle at its home.
+ */
+static void
+move_home(unsigned long pgno, struct msi_page *pg, struct outbox *ob)
+{
+	struct msi_home *h = &ob->home;
+	struct msi_msg msg;
+
+	memset(h, 0, sizeof(*h));
+	h->epoch = pg->home_epoch + 1;
+	h->dir_state = pg->dir_state;
+	h->owner = pg->owner;
+	h->last_writer = pg->last_writer;
+	h->sharers = pg->sharers;
+	h->migratory = pg->migratory;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.requester = self_id;
+	msg.page = pgno;
+	outbox_add(ob, pg->move_to, MSG_HOME, &msg, (const char *) h);
+	ob->m[ob->n - 1].msg.len = sizeof(*h);
+	stat_add(&stats.home_moves, 1);
+
+	pg->home = pg->move_to;
+	pg->home_epoch = h->epoch;
+	pg->dir_state = MSI_INVALID;
+	pg->owner = 0;
+	pg->sharers = 0;
+	pg->last_writer = -1;
+	pg->migratory = 0;
+	pg->move_to = -1;
+}
+
+/* Take over the directory entry of a page whose home moves here.
+ */
+static void
+take_home(unsigned long pgno, struct msi_page *pg, const char *data)
+{
+	struct msi_home h;
+
+	memcpy(&h, data, sizeof(h));
+	if (pg->home == self_id || h.epoch <= pg->home_epoch ||
+	    h.dir_state > MSI_MODIFIED || h.owner < 0 ||
+	    h.owner >= num_nodes || h.last_writer < -1 ||
+	    h.last_writer >= num_nodes ||
+	    (num_nodes < 64 && h.sharers >> num_nodes)) {
+		fprintf(stderr, "Bad directory entry for page %lu\n", pgno);
+		exit(EXIT_FAILURE);
+	}
+	pg->home = self_id;
+	pg->home_epoch = h.epoch;
+	pg->dir_state = h.dir_state;
+	pg->owner = h.owner;
+	pg->last_writer = h.last_writer;
+	pg->sharers = h.sharers;
+	pg->migratory = h.migratory;
+	memset(&asked[pgno * num_nodes], 0, num_nodes * sizeof(*asked));
+}
+
+/* Handle one message delivered to this node, with the buffers of the
+ * calling thread.
+ */
+static void
+dispatch(struct msi_msg *msg, const char *data, struct msi_bufs *bufs)
+{
+	unsigned long pgno = msg->page;
+	struct msi_page *pg = &pages[pgno];
+	struct msi_pending *pend;
+	struct outbox ob;
+	unsigned long t;
+	ssize_t n;
+
+	ob.n = 0;
+	ob.bufs = bufs;
+	lock_page(pgno);
+
+	switch (msg->type) {
+	case MSG_READ_REQ:
+	case MSG_WRITE_REQ:
+		if (pg->home != self_id) {
+			forward_home(pg, msg, &ob);
+		} else if (pg->busy) {
+			pend = malloc(sizeof(*pend));
+			if (pend == NULL)
+				errExit("malloc");
+			pend->msg = *msg;
+			pend->next = NULL;
+			if (pg->tail)
+				pg->tail->next = pend;
+			else
+				pg->head = pend;
+			pg->tail = pend;
+		} else {
+			home_serve(pg, msg, &ob);
+		}
+		break;
+
+	case MSG_FWD_READ:
+	case MSG_FWD_WRITE:
+		if (pg->state == MSI_INVALID) {
+			fprintf(stderr, "Forwarded request for invalid page %lu\n",
+				pgno);
+			exit(EXIT_FAILURE);
+		}
+		/* Protect before copying so that no local write can slip in
+		 * after the copy was taken, or between the copy and the drop.
+		 */
+		if (pg->state == MSI_MODIFIED)
+			protect_page(pgno);
+		memcpy(bufs->copy, region + pgno * pg_size, pg_size);
+
+		/* Half a page of diff is about where applying it stops being
+		 * cheaper than copying the page.
+		 */
+		if (page_is_zero(bufs->copy, pg_size))
+			outbox_page(&ob, MSG_ZERO, msg, NULL, 0, pg->version);
+		else if ((msg->flags & MSI_HAVE_OLD) && pg->twin && bufs->diff &&
+			 pg->twin_version == msg->base &&
+			 (n = diff_encode(pg->twin, bufs->copy, pg_size,
+					  bufs->diff, pg_size / 2)) >= 0)
+			outbox_page(&ob, MSG_DIFF, msg, bufs->diff, n,
+				    pg->version);
+		else
+			outbox_page(&ob, MSG_DATA, msg, bufs->copy, pg_size,
+				    pg->version);
+		ob.m[ob.n - 1].msg.flags |= (msg->flags & MSI_EXCL) |
+			(pg->clean ? MSI_CLEAN : 0);
+		pg->clean = 0;
+
+		if (msg->type == MSG_FWD_WRITE) {
+			drop_page(pgno, bufs->copy);
+			pg->state = MSI_INVALID;
+			prof_inval(pgno);
+		} else {
+			pg->state = MSI_SHARED;
+		}
+		break;
+
+	case MSG_INV:
+		pg->clean = 0;
+		if (pg->state != MSI_INVALID) {
+			drop_page(pgno, region + pgno * pg_size);
+			pg->state = MSI_INVALID;
+			prof_inval(pgno);
+		}
+		outbox_add(&ob, msg->src, MSG_INV_ACK, msg, NULL);
+		break;
+
+	case MSG_INV_ACK:
+		if (--pg->acks == 0)
+			outbox_add(&ob, pg->after_node, pg->after.type,
+				   &pg->after, NULL);
+		break;
+
+	case MSG_DATA:
+	case MSG_DIFF:
+	case MSG_ZERO:
+	case MSG_GRANT:
+		if (pg->wait == NULL || msg->id != pg->id) {
+			fprintf(stderr, "Unexpected reply %u for page %lu\n",
+				msg->id, pgno);
+			exit(EXIT_FAILURE);
+		}
+		if (msg->type == MSG_DATA && (msg->flags & MSI_LZ)) {
+			t = now_ns();
+			n = lz_decompress(data, msg->len, pg->wait->buf, pg_size);
+			if (n != (ssize_t) pg_size) {
+				fprintf(stderr, "Bad compressed page %u for page %lu\n",
+					msg->id, pgno);
+				exit(EXIT_FAILURE);
+			}
+			stat_add(&stats.unlz_ns, now_ns() - t);
+			stat_add(&stats.unlz_pages, 1);
+		} else if (msg->type == MSG_DATA) {
+			memcpy(pg->wait->buf, data, pg_size);
+		} else if (msg->type == MSG_DIFF) {
+			if (pg->twin == NULL || pg->twin_version != msg->base) {
+				fprintf(stderr, "No copy to apply diff %u for page %lu\n",
+					msg->id, pgno);
+				exit(EXIT_FAILURE);
+			}
+			memcpy(pg->wait->buf, pg->twin, pg_size);
+			if (diff_apply(pg->wait->buf, pg_size, data, msg->len) == -1) {
+				fprintf(stderr, "Bad diff %u for page %lu\n",
+					msg->id, pgno);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (msg->type != MSG_GRANT) {
+			pg->wait->fetched = msg->type != MSG_ZERO;
+			pg->wait->zero = msg->type == MSG_ZERO;
+			pg->version = msg->version;
+			prof_bytes(pgno, msg->len);
+		}
+		pg->excl = !pg->write && (msg->flags & MSI_EXCL);
+		pg->was_clean = (msg->flags & MSI_CLEAN) != 0;
+
+		/* Write permission starts a new version; in diff mode the
+		 * one it starts from is the twin. Under LRC the twin is what
+		 * the release diffs against.
+		 */
+		if (pg->write || pg->excl) {
+			if (diff_on || lrc_on)
+				save_twin(pg, pg->wait->fetched ? pg->wait->buf :
+					  pg->wait->zero ? zero_page :
+					  region + pgno * pg_size, pg->version);
+			if (lrc_on)
+				mark_dirty(pgno);
+			else
+				prof_transfer(pgno);
+			pg->version++;
+		}
+		wake_waiter(pgno);
+		break;
+
+	case MSG_UNBLOCK:
+		if (pg->home != self_id) {
+			forward_home(pg, msg, &ob);
+			break;
+		}
+		if (!pg->busy || msg->requester != pg->busy_node ||
+		    msg->id != pg->busy_id) {
+			fprintf(stderr, "Unexpected unblock %u for page %lu\n",
+				msg->id, pgno);
+			exit(EXIT_FAILURE);
+		}
+		pg->busy = 0;
+		if (msg->flags & MSI_CLEAN && pg->migratory) {
+			pg->migratory = 0;
+			stat_add(&stats.mig_reverted, 1);
+		}
+		pend = pg->head;
+		if (pend) {
+			pg->head = pend->next;
+			if (pg->head == NULL)
+				pg->tail = NULL;
+			home_serve(pg, &pend->msg, &ob);
+			free(pend);
+		} else if (pg->move_to != -1) {
+			move_home(pgno, pg, &ob);
+		}
+		break;
+
+	case MSG_HOME:
+		take_home(pgno, pg, data);
+		break;
+
+	case MSG_MOVED:
+		/* Only news newer than ours; the home itself knows best */
+		if (msg->base >= num_nodes) {
+			fprintf(stderr, "Bad home %u for page %lu\n", msg->base,
+				pgno);
+			exit(EXIT_FAILURE);
+		}
+		if (msg->version > pg->home_epoch) {
+			pg->home = msg->base;
+			pg->home_epoch = msg->version;
+		}
+		break;
+
+	case MSG_FETCH:
+		if (pg->master == NULL || page_is_zero(pg->master, pg_size))
+			outbox_page(&ob, MSG_ZERO, msg, NULL, 0, 0);
+		else
+			outbox_page(&ob, MSG_DATA, msg, pg->master, pg_size, 0);
+		break;
+
+	case MSG_FLUSH:
+		if (pg->master == NULL) {
+			pg->master = calloc(1, pg_size);
+			if (pg->master == NULL)
+				errExit("calloc");
+		}
+		if (msg->flags & MSI_WHOLE) {
+			memcpy(pg->master, data, pg_size);
+		} else if (diff_apply(pg->master, pg_size, data, msg->len) == -1) {
+			fprintf(stderr, "Bad flush %u for page %lu\n", msg->id,
+				pgno);
+			exit(EXIT_FAILURE);
+		}
+		prof_bytes(pgno, msg->len);
+		outbox_add(&ob, msg->src, MSG_FLUSH_ACK, msg, NULL);
+		break;
+
+	default:
+		fprintf(stderr, "Unknown message type %d\n", msg->type);
+		exit(EXIT_FAILURE);
+	}
+
+	unlock_page(pgno);
+	outbox_flush(&ob);
+}
+
+/* Send node the write notices of our intervals after base, or tell it to
+ * drop everything if they do not fit in a message. Called with lrc_lock
+ * held.
+ */
+static void
+send_notices(int node, uint32_t base)
+{
+	struct lrc_interval *iv;
+	struct msi_msg msg;
+	uint64_t *buf = NULL;
+	unsigned long n = 0, max = pg_size / sizeof(*buf);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_NOTICE;
+	msg.requester = node;
+	msg.version = interval;
+
+	for (iv = log_head; iv; iv = iv->next) {
+		if (iv->id <= base)
+			continue;
+		if (n + iv->n > max) {
+			msg.flags = MSI_ALL;
+			n = 0;
+			break;
+		}
+		buf = realloc(buf, (n + iv->n) * sizeof(*buf));
+		if (buf == NULL)
+			errExit("realloc");
+		for (unsigned long i = 0; i < iv->n; i++)
+			buf[n++] = iv->pages[i];
+	}
+	msg.len = n * sizeof(*buf);
+	send_msg(node, &msg, (const char *) buf);
+	free(buf);
+}
+
+/* Forget the intervals every other node has seen. Called with lrc_lock
+ * held.
+ */
+static void
+trim_log(void)
+{
+	struct lrc_interval *iv;
+	uint32_t low = interval;
+
+	for (int k = 0; k < num_nodes; k++)
+		if (k != self_id && known[k] < low)
+			low = known[k];
+	while (log_head && log_head->id <= low) {
+		iv = log_head;
+		log_head = iv->next;
+		free(iv->pages);
+		free(iv);
+	}
+	if (log_head == NULL)
+		log_tail = NULL;
+}
+
+/* Messages of the release consistency protocol that are about no page.
+ */
+static void
+lrc_dispatch(struct msi_msg *msg, const char *data)
+{
+	const uint64_t *notice = (const uint64_t *) data;
+
+	pthread_mutex_lock(&lrc_lock);
+	switch (msg->type) {
+	case MSG_FLUSH_ACK:
+		flush_acks--;
+		break;
+
+	case MSG_ACQUIRE:
+		/* The acquirer has seen every interval up to base */
+		known[msg->src] = msg->base;
+		send_notices(msg->src, msg->base);
+		trim_log();
+		break;
+
+	case MSG_NOTICE:
+		for (unsigned long i = 0; i < msg->len / sizeof(*notice); i++) {
+			if (notice[i] >= num_pages) {
+				fprintf(stderr, "Bad page %lu from node %d\n",
+					(unsigned long) notice[i], msg->src);
+				exit(EXIT_FAILURE);
+			}
+			list_add(&noticed, notice[i]);
+		}
+		if (msg->flags & MSI_ALL)
+			notice_all = 1;
+		seen[msg->src] = msg->version;
+		notices_due--;
+		break;
+	}
+	pthread_cond_broadcast(&lrc_cond);
+	pthread_mutex_unlock(&lrc_lock);
+}
+
+static int
+lock_home(unsigned int lock)
+{
+	return lock % num_nodes;
+}
+
+/* Hand a lock we hold the token of to node, along with what that node
+ * needs to know of our releases: the intervals we have seen of every
+ * node, counting our own, then the pages of ours it has not seen yet, or
+ * MSI_ALL. Called with sync_state_lock held.
+ */
+static void
+pass_lock(unsigned int lock, int node, const uint32_t *node_seen)
+{
+	struct lrc_interval *iv;
+	struct msi_msg msg;
+	size_t vec = num_nodes * sizeof(uint32_t);
+	unsigned long n = 0, max = pg_size / sizeof(uint64_t);
+	uint64_t page;
+	char *buf;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_LOCK_GRANT;
+	msg.requester = node;
+	msg.page = lock;
+	locks[lock].token = 0;
+
+	pthread_mutex_lock(&lrc_lock);
+	buf = malloc(vec + pg_size);
+	if (buf == NULL)
+		errExit("malloc");
+	memcpy(buf, seen, vec);
+	memcpy(buf + self_id * sizeof(uint32_t), &interval, sizeof(uint32_t));
+	for (iv = log_head; iv; iv = iv->next) {
+		if (iv->id <= node_seen[self_id])
+			continue;
+		if (n + iv->n > max) {
+			msg.flags = MSI_ALL;
+			n = 0;
+			break;
+		}
+		for (unsigned long i = 0; i < iv->n; i++) {
+			page = iv->pages[i];
+			memcpy(buf + vec + n++ * sizeof(page), &page, sizeof(page));
+		}
+	}
+	if (node != self_id) {
+		known[node] = node_seen[self_id];
+		trim_log();
+	}
+	pthread_mutex_unlock(&lrc_lock);
+
+	msg.len = vec + n * sizeof(uint64_t);
+	send_msg(node, &msg, buf);
+	free(buf);
+}
+
+/* Messages about locks and the barrier.
+ */
+static void
+sync_dispatch(struct msi_msg *msg, const char *data)
+{
+	struct lock_state *lk = &locks[msg->page];
+	size_t vec = num_nodes * sizeof(uint32_t);
+	struct msi_msg fwd;
+
+	pthread_mutex_lock(&sync_state_lock);
+	switch (msg->type) {
+	case MSG_LOCK_REQ:
+		/* Queue the requester behind whoever asked last */
+		fwd = *msg;
+		fwd.type = MSG_LOCK_FWD;
+		send_msg(lk->tail, &fwd, data);
+		lk->tail = msg->requester;
+		break;
+
+	case MSG_LOCK_FWD:
+		if (lk->token && !lk->held) {
+			pass_lock(msg->page, msg->requester,
+				  (const uint32_t *) data);
+			break;
+		}
+		if (lk->next != -1) {
+			fprintf(stderr, "Second successor for lock %lu\n",
+				(unsigned long) msg->page);
+			exit(EXIT_FAILURE);
+		}
+		lk->next = msg->requester;
+		lk->next_seen = malloc(vec);
+		if (lk->next_seen == NULL)
+			errExit("malloc");
+		memcpy(lk->next_seen, data, vec);
+		break;
+
+	case MSG_LOCK_GRANT:
+		/* The thread waiting for it holds it from now on, so that a
+		 * request forwarded meanwhile waits for its unlock.
+		 */
+		lk->grant = malloc(msg->len);
+		if (lk->grant == NULL)
+			errExit("malloc");
+		memcpy(lk->grant, data, msg->len);
+		lk->grant_len = msg->len;
+		lk->grant_src = msg->src;
+		lk->grant_all = !!(msg->flags & MSI_ALL);
+		lk->token = 1;
+		lk->held = 1;
+		break;
+
+	case MSG_BARRIER:
+		arrived_at[msg->src] = msg->version;
+		if (++arrived < num_nodes)
+			break;
+		arrived = 0;
+		memset(&fwd, 0, sizeof(fwd));
+		fwd.type = MSG_BARRIER_GO;
+		fwd.len = vec;
+		for (int j = 0; j < num_nodes; j++)
+			send_msg(j, &fwd, (const char *) arrived_at);
+		break;
+
+	case MSG_BARRIER_GO:
+		memcpy(barrier_at, data, vec);
+		barrier_gen++;
+		break;
+	}
+	pthread_cond_broadcast(&sync_cond);
+	pthread_mutex_unlock(&sync_state_lock);
+}
+
+/* Whether len is right for a message of type type.
+ */
+static int
+len_ok(struct msi_msg *msg)
+{
+	size_t vec = num_nodes * sizeof(uint32_t);
+
+	switch (msg->type) {
+	case MSG_LOCK_REQ:
+	case MSG_LOCK_FWD:
+	case MSG_BARRIER_GO:
+		return msg->len == vec;
+	case MSG_LOCK_GRANT:
+		return msg->len >= vec && msg->len - vec <= pg_size &&
+		       (msg->len - vec) % sizeof(uint64_t) == 0;
+	case MSG_DATA:
+		if (msg->flags & MSI_LZ)
+			return msg->len <= pg_size;
+		return msg->len == pg_size;
+	case MSG_FLUSH:
+		if (msg->flags & MSI_WHOLE)
+			return msg->len == pg_size;
+		return msg->len <= pg_size;
+	case MSG_DIFF:
+		return msg->len <= pg_size;
+	case MSG_HOME:
+		return msg->len == sizeof(struct msi_home);
+	case MSG_NOTICE:
+		return msg->len <= pg_size && msg->len % sizeof(uint64_t) == 0;
+	default:
+		return msg->len == 0;
+	}
+}
+
+/* Hand a message delivered to this node to the code that deals with it.
+ */
+static void
+deliver(struct msi_msg *msg, const char *data, struct msi_bufs *bufs)
+{
+	if (msg->type == MSG_FLUSH_ACK || msg->type == MSG_ACQUIRE ||
+	    msg->type == MSG_NOTICE)
+		lrc_dispatch(msg, data);
+	else if (msg->type >= MSG_LOCK_REQ)
+		sync_dispatch(msg, data);
+	else
+		dispatch(msg, data, bufs);
+}
+
+/* Make sure the header of a message from node is one we can act on.
+ */
+static void
+check_header(struct msi_msg *msg, int node)
+{
+	if (msg->magic != MSI_MAGIC || msg->src != node ||
+	    msg->count != 1 || !len_ok(msg)) {
+		fprintf(stderr, "Bad message header from node %d\n", node);
+		exit(EXIT_FAILURE);
+	}
+	if (msg->page >= (msg->type >= MSG_LOCK_REQ ? DSM_LOCKS : num_pages)) {
+		fprintf(stderr, "Bad page %lu from node %d\n",
+			(unsigned long) msg->page, node);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Dispatch every whole message in rx that has arrived from node, over a
+ * data lane if ln is set.
+ */
+static void
+rx_dispatch(struct rx *rx, int node, struct lane *ln)
+{
+	struct msi_msg msg;
+	size_t off = 0, need;
+
+	while (rx->have - off >= sizeof(msg)) {
+		memcpy(&msg, rx->buf + off, sizeof(msg));
+		check_header(&msg, node);
+		if (ln && !on_lane(msg.type)) {
+			fprintf(stderr, "Message %d from node %d on a data lane\n",
+				msg.type, node);
+			exit(EXIT_FAILURE);
+		}
+		need = sizeof(msg) + msg.len;
+		if (rx->have - off < need)
+			break;
+		deliver(&msg, rx->buf + off + sizeof(msg),
+			ln ? &ln->bufs : &reactor_bufs);
+		off += need;
+	}
+
+	memmove(rx->buf, rx->buf + off, rx->have - off);
+	rx->have -= off;
+}
+
+/* The connection to node has been closed from the other end, which is
+ * only expected once every node is shutting down.
+ */
+static void
+peer_closed(int node)
+{
+	if (!__atomic_load_n(&closing, __ATOMIC_ACQUIRE)) {
+		fprintf(stderr, "Peer closed the connection\n");
+		exit(EXIT_FAILURE);
+	}
+	if (net_transport == DSM_SOCKETS)
+		close(peer_fd[node]);
+	peer_fd[node] = -1;
+}
+
+static void
+peer_ready(int fd, void *arg)
+{
+	int node = (long) arg;
+	struct rx *rx = &peer_rx[node];
+	ssize_t n;
+
+	n = recv(fd, rx->buf + rx->have, rx_size - rx->have, MSG_DONTWAIT);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n == -1)
+		errExit("recv");
+	if (n == 0) {
+		peer_closed(node);
+		return;
+	}
+	rx->have += n;
+	rx_dispatch(rx, node, NULL);
+}
+
+/* Bytes from node picked up by a multishot receive.
+ */
+static void
+peer_data(void *arg, const char *data, size_t len)
+{
+	int node = (long) arg;
+	struct rx *rx = &peer_rx[node];
+	size_t n;
+
+	if (len == 0)
+		peer_closed(node);
+	while (len > 0) {
+		n = rx_size - rx->have < len ? rx_size - rx->have : len;
+		memcpy(rx->buf + rx->have, data, n);
+		rx->have += n;
+		data += n;
+		len -= n;
+		rx_dispatch(rx, node, NULL);
+	}
+}
+
+/* Dispatch the messages in the ring from node, in place, until it is
+ * empty and the writer knows to wake us.
+ */
+static void
+ring_ready(int fd, void *arg)
+{
+	int node = (long) arg;
+	struct shm_link *l = peer_link[node];
+	struct msi_msg msg;
+	const char *p;
+	eventfd_t v;
+	size_t len;
+
+	if (eventfd_read(fd, &v) == -1 && errno != EAGAIN)
+		errExit("eventfd_read");
+
+	do {
+		while ((p = shm_next(l, &len)) != NULL) {
+			if (len < sizeof(msg)) {
+				fprintf(stderr, "Short message from node %d\n",
+					node);
+				exit(EXIT_FAILURE);
+			}
+			memcpy(&msg, p, sizeof(msg));
+			check_header(&msg, node);
+			if (len != sizeof(msg) + msg.len) {
+				fprintf(stderr, "Bad message length from node "
+					"%d\n", node);
+				exit(EXIT_FAILURE);
+			}
+			deliver(&msg, p + sizeof(msg), &reactor_bufs);
+			shm_done(l, len);
+		}
+	} while (!shm_sleep(l));
+}
+
+static void
+mbox_ready(int fd, void *arg)
+{
+	struct mbox_item *items, *it;
+	eventfd_t v;
+
+	if (eventfd_read(fd, &v) == -1 && errno != EAGAIN)
+		errExit("eventfd_read");
+
+	items = mbox_take(&mbox[self_id], 0);
+	for (it = items; it; it = it->next)
+		deliver(&it->msg, it->data, &reactor_bufs);
+	free_items(items);
+}
+
+/* Write a queue of messages with as few system calls as possible.
+ */
+static void
+write_items(int fd, struct mbox_item *it)
+{
+	struct iovec iov[MAX_IOV];
+	ssize_t n;
+	int cnt, i;
+
+	while (it) {
+		cnt = fill_iov(iov, &it);
+
+		for (i = 0; i < cnt; ) {
+			n = writev(fd, iov + i, cnt - i < IOV_MAX ? cnt - i : IOV_MAX);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				errExit("writev");
+			while (i < cnt && (size_t) n >= iov[i].iov_len)
+				n -= iov[i++].iov_len;
+			if (i < cnt) {
+				iov[i].iov_base = (char *) iov[i].iov_base + n;
+				iov[i].iov_len -= n;
+			}
+		}
+	}
+}
+
+static void *
+sender_thread(void *arg)
+{
+	int node = (long) arg;
+	struct shm_link *l = peer_link[node];
+	struct mbox_item *items, *it;
+
+	for (;;) {
+		items = mbox_take(&mbox[node], 1);
+		if (l == NULL) {
+			write_items(peer_fd[node], items);
+		} else {
+			for (it = items; it; it = it->next)
+				shm_put(l, &it->msg, sizeof(it->msg), it->data,
+					it->msg.len);
+			shm_push(l);
+		}
+		free_items(items);
+		mbox_done(&mbox[node]);
+	}
+	return NULL;
+}
+
+static void *
+lane_sender(void *arg)
+{
+	struct lane *ln = arg;
+	struct mbox_item *items;
+
+	for (;;) {
+		items = mbox_take(&ln->mbox, 1);
+		write_items(ln->fd, items);
+		free_items(items);
+		mbox_done(&ln->mbox);
+	}
+	return NULL;
+}
+
+/* Handle what arrives on a data lane. Each message is about one page and
+ * takes its stripe lock, like those the reactor handles.
+ */
+static void *
+lane_receiver(void *arg)
+{
+	struct lane *ln = arg;
+	ssize_t n;
+
+	for (;;) {
+		n = recv(ln->fd, ln->rx.buf + ln->rx.have,
+			 rx_size - ln->rx.have, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			errExit("recv");
+		if (n == 0) {
+			if (!__atomic_load_n(&closing, __ATOMIC_ACQUIRE)) {
+				fprintf(stderr, "Peer closed the connection\n");
+				exit(EXIT_FAILURE);
+			}
+			return NULL;
+		}
+		ln->rx.have += n;
+		rx_dispatch(&ln->rx, ln->node, ln);
+	}
+}
+
+/* Bring up the data lanes to node, if it has them.
+ */
+static void
+start_lanes(int node)
+{
+	struct lane *ln;
+	pthread_t thr;
+	int s, fd, one = 1;
+
+	for (int k = 0; k < DSM_DATA_LANES; k++) {
+		fd = cluster_lane(node, k);
+		if (fd == -1)
+			return;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		ln = &lanes[node][k];
+		ln->node = node;
+		ln->rx.buf = malloc(rx_size);
+		if (ln->rx.buf == NULL)
+			errExit("malloc");
+		ln->bufs.copy = malloc(pg_size);
+		if (diff_on)
+			ln->bufs.diff = malloc(pg_size);
+		if (lz_on)
+			ln->bufs.lz = malloc(pg_size);
+		if (ln->bufs.copy == NULL || (diff_on && ln->bufs.diff == NULL) ||
+		    (lz_on && ln->bufs.lz == NULL))
+			errExit("malloc");
+		ln->fd = fd;
+		s = pthread_create(&thr, NULL, lane_sender, ln);
+		if (s == 0)
+			s = pthread_create(&thr, NULL, lane_receiver, ln);
+		if (s != 0) {
+			errno = s;
+			errExit("pthread_create");
+		}
+	}
+}
+
+void
+msi_init(int self, int nnodes, struct dsm_region *r, int transport)
+{
+
+	if (nnodes < 1 || nnodes > MAX_NODES || self < 0 || self >= nnodes) {
+		fprintf(stderr, "Bad node %d of %d\n", self, nnodes);
+		exit(EXIT_FAILURE);
+	}
+
+	self_id = self;
+	net_transport = transport;
+	num_nodes = nnodes;
+	rgn = r;
+	region = r->base;
+	pg_size = r->granule;
+	num_pages = r->len / pg_size;
+	region_uffd = r->uffd;
+
+	pages = calloc(num_pages, sizeof(*pages));
+	asked = calloc(num_pages * nnodes, sizeof(*asked));
+	zero_page = calloc(1, pg_size);
+	reactor_bufs.copy = malloc(pg_size);
+	reactor_bufs.diff = malloc(pg_size);
+	reactor_bufs.lz = malloc(pg_size);
+	if (pages == NULL || asked == NULL || zero_page == NULL ||
+	    reactor_bufs.copy == NULL || reactor_bufs.diff == NULL ||
+	    reactor_bufs.lz == NULL)
+		errExit("calloc");
+	for (unsigned long i = 0; i < num_pages; i++) {
+		pages[i].last_writer = -1;
+		pages[i].home = home_of(i);
+		pages[i].move_to = -1;
+	}
+	rx_size = sizeof(struct msi_msg) + pg_size + RX_SPARE;
+
+	for (int i = 0; i < NSTRIPES; i++) {
+		pthread_mutex_init(&stripe_lock[i], NULL);
+		pthread_cond_init(&stripe_cond[i], NULL);
+	}
+	for (int i = 0; i < MAX_NODES; i++) {
+		peer_fd[i] = -1;
+		pthread_mutex_init(&mbox[i].lock, NULL);
+		pthread_cond_init(&mbox[i].cond, NULL);
+		pthread_cond_init(&mbox[i].idle, NULL);
+		mbox[i].efd = -1;
+		for (int k = 0; k < DSM_DATA_LANES; k++) {
+			lanes[i][k].fd = -1;
+			pthread_mutex_init(&lanes[i][k].mbox.lock, NULL);
+			pthread_cond_init(&lanes[i][k].mbox.cond, NULL);
+			pthread_cond_init(&lanes[i][k].mbox.idle, NULL);
+			lanes[i][k].mbox.efd = -1;
+		}
+	}
+
+	/* Every lock starts out at its manager, free */
+	for (int i = 0; i < DSM_LOCKS; i++) {
+		pthread_mutex_init(&locks[i].local, NULL);
+		locks[i].tail = lock_home(i);
+		locks[i].token = lock_home(i) == self;
+		locks[i].next = -1;
+	}
+
+	/* Messages to ourselves, like those from peers, are handled on the
+	 * reactor thread.
+	 */
+	mbox[self].efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (mbox[self].efd == -1)
+		errExit("eventfd");
+	reactor_init(transport);
+	reactor_add(mbox[self].efd, mbox_ready, NULL);
+}
+
+void
+msi_set_diff(int on)
+{
+	diff_on = on;
+}
+
+void
+msi_set_compress(int on)
+{
+	lz_on = on;
+}
+
+void
+msi_set_migratory(int on)
+{
+	migratory_on = on;
+}
+
+void
+msi_set_home_moves(int on)
+{
+	moves_on = on;
+}
+
+void
+msi_set_lanes(int on)
+{
+	lanes_on = on;
+}
+
+void
+msi_set_lrc(int on)
+{
+	lrc_on = on;
+}
+
+void
+msi_stats(struct msi_stats *st)
+{
+	const unsigned long *from = (const unsigned long *) &stats;
+	unsigned long *to = (unsigned long *) st;
+
+	/* Every field is an unsigned long counter */
+	for (size_t i = 0; i < sizeof(*st) / sizeof(*to); i++)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+static void
+write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			errExit("write");
+		buf = (const char *) buf + n;
+		len -= n;
+	}
+}
+
+static void
+read_all(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == 0) {
+			fprintf(stderr, "Connection closed\n");
+			exit(EXIT_FAILURE);
+		}
+		if (n == -1)
+			errExit("read");
+		buf = (char *) buf + n;
+		len -= n;
+	}
+}
+
+void
+msi_send_region(int fd, struct dsm_region *r)
+{
+	struct msi_msg msg;
+	struct msi_region d;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = MSI_MAGIC;
+	msg.type = MSG_REGION;
+	msg.count = 1;
+	msg.len = sizeof(d);
+
+	memset(&d, 0, sizeof(d));
+	d.base = (uintptr_t) r->base;
+	d.len = r->len;
+	d.granule = r->granule;
+	d.backing = r->backing;
+	d.lrc = lrc_on;
+
+	write_all(fd, &msg, sizeof(msg));
+	write_all(fd, &d, sizeof(d));
+}
+
+char *
+msi_recv_region(int fd, struct dsm_region *r)
+{
+	struct msi_msg msg;
+	struct msi_region d;
+
+	read_all(fd, &msg, sizeof(msg));
+	if (msg.magic != MSI_MAGIC || msg.type != MSG_REGION ||
+	    msg.len != sizeof(d)) {
+		fprintf(stderr, "Expected a region description\n");
+		exit(EXIT_FAILURE);
+	}
+	read_all(fd, &d, sizeof(d));
+
+	r->len = d.len;
+	r->granule = d.granule;
+	r->backing = d.backing;
+	lrc_on = d.lrc;
+	return (char *) (uintptr_t) d.base;
+}
+
+void
+msi_add_peer(int node, int fd)
+{
+	pthread_t thr;
+	int s, one = 1;
+
+	/* Messages are small and a fault waits for each of them; do not let
+	 * Nagle hold them back. Sockets other than TCP simply refuse.
+	 */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	peer_fd[node] = fd;
+	peer_rx[node].buf = malloc(rx_size);
+	if (peer_rx[node].buf == NULL)
+		errExit("malloc");
+	peer_rx[node].have = 0;
+
+	/* A node on this host gets our messages through shared memory,
+	 * written by the thread sending them or, once they queue up, by a
+	 * sender thread whatever the transport. The socket carries nothing
+	 * more, but still tells us when the node goes away, and the lanes
+	 * nothing at all.
+	 */
+	if (shm_link(node) != NULL &&
+	    sizeof(struct msi_msg) + pg_size <= SHM_MAX_RECORD) {
+		peer_link[node] = shm_link(node);
+		cluster_close_lanes(node);
+		s = pthread_create(&thr, NULL, sender_thread,
+				   (void *) (long) node);
+		if (s != 0) {
+			errno = s;
+			errExit("pthread_create");
+		}
+		reactor_add(shm_fd(peer_link[node]), ring_ready,
+			    (void *) (long) node);
+		if (net_transport == DSM_URING)
+			uring_recv(fd, peer_data, (void *) (long) node);
+		else
+			reactor_add(fd, peer_ready, (void *) (long) node);
+		return;
+	}
+
+	if (lanes_on)
+		start_lanes(node);
+	else
+		cluster_close_lanes(node);
+
+	if (net_transport == DSM_URING) {
+		uring_recv(fd, peer_data, (void *) (long) node);
+		uring_tx(node);
+		return;
+	}
+
+	s = pthread_create(&thr, NULL, sender_thread, (void *) (long) node);
+	if (s != 0) {
+		errno = s;
+		errExit("pthread_create");
+	}
+	reactor_add(fd, peer_ready, (void *) (long) node);
+}
+
+/* Use the local copy if it is good enough, or send a request that w
+ * waits for. Called with the stripe lock held and no request for the page
+ * in flight; returns with the lock dropped.
+ */
+static int
+start_fetch(unsigned long pgno, int write, struct msi_wait *w)
+{
+	struct msi_page *pg = &pages[pgno];
+	struct msi_msg msg;
+	int home;
+
+	if (pg->state == MSI_MODIFIED || (pg->state == MSI_SHARED && !write)) {
+		/* A write fault can be queued behind the upgrade that made
+		 * the page Modified. Lift the protection under the lock so a
+		 * concurrent downgrade cannot be undone.
+		 */
+		if (write && pg->state == MSI_MODIFIED) {
+			unprotect_page(pgno);
+			pg->clean = 0;
+		}
+		unlock_page(pgno);
+		return MSI_PRESENT;
+	}
+
+	w->done = 0;
+	w->fetched = 0;
+	w->zero = 0;
+	pg->inflight = 1;
+	pg->write = write;
+	pg->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+	pg->wait = w;
+
+	/* Under LRC a Shared copy may be written without asking anybody.
+	 * The twin keeps what it was, for the release to diff against.
+	 */
+	if (lrc_on && pg->state == MSI_SHARED) {
+		save_twin(pg, region + pgno * pg_size, pg->version);
+		mark_dirty(pgno);
+		pg->version++;
+		wake_waiter(pgno);
+		unlock_page(pgno);
+		return MSI_PENDING;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = lrc_on ? MSG_FETCH : write ? MSG_WRITE_REQ : MSG_READ_REQ;
+	msg.requester = self_id;
+	msg.id = pg->id;
+	msg.page = pgno;
+	/* Only a missing page gets its data from a holder; an upgrade is
+	 * granted, or if an invalidation overtakes it, answered in full.
+	 */
+	if (!lrc_on && pg->state == MSI_INVALID && pg->twin) {
+		msg.flags = MSI_HAVE_OLD;
+		msg.base = pg->twin_version;
+	}
+	home = pg->home;
+	unlock_page(pgno);
+	send_msg(home, &msg, NULL);
+	return MSI_PENDING;
+}
+
+int
+msi_fetch_begin(unsigned long pgno, int write, struct msi_wait *w)
+{
+	lock_page(pgno);
+	if (pages[pgno].inflight) {
+		unlock_page(pgno);
+		return MSI_BUSY;
+	}
+	return start_fetch(pgno, write, w);
+}
+
+int
+msi_fetch_done(unsigned long pgno, struct msi_wait *w)
+{
+	int done;
+
+	lock_page(pgno);
+	done = w->done;
+	unlock_page(pgno);
+	return done;
+}
+
+int
+msi_fetch_end(unsigned long pgno, struct msi_wait *w)
+{
+	lock_page(pgno);
+	while (!w->done)
+		pthread_cond_wait(&stripe_cond[pgno % NSTRIPES],
+				  &stripe_lock[pgno % NSTRIPES]);
+	pages[pgno].wait = NULL;
+	unlock_page(pgno);
+
+	if (w->zero)
+		return MSI_ZERO;
+	return w->fetched ? MSI_FETCHED : MSI_GRANTED;
+}
+
+int
+msi_fetch(unsigned long pgno, int write, char *buf)
+{
+	struct msi_wait w;
+
+	lock_page(pgno);
+	while (pages[pgno].inflight)
+		pthread_cond_wait(&stripe_cond[pgno % NSTRIPES],
+				  &stripe_lock[pgno % NSTRIPES]);
+
+	w.buf = buf;
+	w.notify = NULL;
+	if (start_fetch(pgno, write, &w) == MSI_PRESENT)
+		return MSI_PRESENT;
+	return msi_fetch_end(pgno, &w);
+}
+
+void
+msi_complete(unsigned long pgno, int write)
+{
+	struct msi_page *pg = &pages[pgno];
+	struct msi_msg msg;
+	int home;
+
+	lock_page(pgno);
+	pg->state = write || pg->excl ? MSI_MODIFIED : MSI_SHARED;
+	pg->clean = !write && pg->excl;
+	pg->excl = 0;
+	pg->inflight = 0;
+	pthread_cond_broadcast(&stripe_cond[pgno % NSTRIPES]);
+	if (lrc_on) {
+		/* The home keeps no record of who holds the page */
+		unlock_page(pgno);
+		return;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_UNBLOCK;
+	msg.requester = self_id;
+	msg.id = pg->id;
+	msg.page = pgno;
+	if (pg->was_clean)
+		msg.flags = MSI_CLEAN;
+	home = pg->home;
+	unlock_page(pgno);
+
+	send_msg(home, &msg, NULL);
+}
+
+void
+msi_acquire(unsigned long pgno, int write)
+{
+	struct uffdio_copy uffdio_copy;
+	struct uffdio_zeropage zp;
+	struct uffdio_writeprotect wp;
+	char *buf;
+	int r;
+
+	buf = malloc(pg_size);
+	if (buf == NULL)
+		errExit("malloc");
+
+	r = msi_fetch(pgno, write, buf);
+	if (r == MSI_ZERO && write && rgn->backing == DSM_ANON) {
+		zp.range.start = (unsigned long) region + pgno * pg_size;
+		zp.range.len = pg_size;
+		zp.mode = 0;
+		if (ioctl(region_uffd, UFFDIO_ZEROPAGE, &zp) == -1 &&
+		    errno != EEXIST)
+			errExit("ioctl-UFFDIO_ZEROPAGE");
+	} else if (r == MSI_FETCHED || r == MSI_ZERO) {
+		uffdio_copy.src = (unsigned long) (r == MSI_ZERO ? zero_page : buf);
+		uffdio_copy.dst = (unsigned long) region + pgno * pg_size;
+		uffdio_copy.len = pg_size;
+		uffdio_copy.mode = write ? 0 : UFFDIO_COPY_MODE_WP;
+		uffdio_copy.copy = 0;
+		if (ioctl(region_uffd, UFFDIO_COPY, &uffdio_copy) == -1 &&
+		    errno != EEXIST)
+			errExit("ioctl-UFFDIO_COPY");
+	} else if (r == MSI_GRANTED) {
+		wp.range.start = (unsigned long) region + pgno * pg_size;
+		wp.range.len = pg_size;
+		wp.mode = 0;
+		if (ioctl(region_uffd, UFFDIO_WRITEPROTECT, &wp) == -1)
+			errExit("ioctl-UFFDIO_WRITEPROTECT");
+	}
+	if (r != MSI_PRESENT)
+		msi_complete(pgno, write);
+
+	free(buf);
+}
+
+int
+msi_state(unsigned long pgno)
+{
+	return pages[pgno].state;
+}
+
+/* Send the changes made to a Modified page since its twin was taken to
+ * the home, and keep the page as a Shared copy. Called with the stripe
+ * lock held; buf is a page-sized buffer for the diff.
+ */
+static void
+flush_page(unsigned long pgno, char *buf)
+{
+	struct msi_page *pg = &pages[pgno];
+	char *data = region + pgno * pg_size;
+	struct msi_msg msg;
+	ssize_t n;
+
+	protect_page(pgno);
+	pg->state = MSI_SHARED;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_FLUSH;
+	msg.requester = self_id;
+	msg.page = pgno;
+	n = diff_encode(pg->twin, data, pg_size, buf, pg_size / 2);
+	if (n >= 0) {
+		msg.len = n;
+		data = buf;
+	} else {
+		msg.flags = MSI_WHOLE;
+		msg.len = pg_size;
+	}
+
+	pthread_mutex_lock(&lrc_lock);
+	flush_acks++;
+	pthread_mutex_unlock(&lrc_lock);
+	__atomic_add_fetch(&stats.flushes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.flush_bytes, msg.len, __ATOMIC_RELAXED);
+	prof_transfer(pgno);
+	send_msg(pg->home, &msg, data);
+}
+
+/* Wait until no request for the page is in flight. Called with its
+ * stripe lock held.
+ */
+static void
+wait_idle(unsigned long pgno)
+{
+	while (pages[pgno].inflight)
+		pthread_cond_wait(&stripe_cond[pgno % NSTRIPES],
+				  &stripe_lock[pgno % NSTRIPES]);
+}
+
+static void
+release(void)
+{
+	struct page_list wrote = { 0 };
+	struct lrc_interval *iv;
+	char *buf;
+
+	if (!lrc_on)
+		return;
+	buf = malloc(pg_size);
+	if (buf == NULL)
+		errExit("malloc");
+
+	pthread_mutex_lock(&sync_lock);
+	pthread_mutex_lock(&lrc_lock);
+	list_move(&wrote, &dirty);
+	pthread_mutex_unlock(&lrc_lock);
+
+	for (unsigned long i = 0; i < wrote.n; i++) {
+		lock_page(wrote.pages[i]);
+		wait_idle(wrote.pages[i]);
+		if (pages[wrote.pages[i]].state == MSI_MODIFIED)
+			flush_page(wrote.pages[i], buf);
+		unlock_page(wrote.pages[i]);
+	}
+
+	/* The next node to acquire must find the changes at the homes */
+	pthread_mutex_lock(&lrc_lock);
+	while (flush_acks > 0)
+		pthread_cond_wait(&lrc_cond, &lrc_lock);
+	list_move(&wrote, &flushed);
+	if (wrote.n > 0) {
+		iv = malloc(sizeof(*iv));
+		if (iv == NULL)
+			errExit("malloc");
+		iv->id = ++interval;
+		iv->n = wrote.n;
+		iv->pages = wrote.pages;
+		iv->next = NULL;
+		if (log_tail)
+			log_tail->next = iv;
+		else
+			log_head = iv;
+		log_tail = iv;
+	} else {
+		free(wrote.pages);
+	}
+	pthread_mutex_unlock(&lrc_lock);
+	pthread_mutex_unlock(&sync_lock);
+	free(buf);
+}
+
+/* Drop the copies of pages named in write notices, or of every page if
+ * all is set. Our own changes to such a page go home first, to be merged
+ * with theirs; they belong to the interval the next release closes.
+ * Called with sync_lock held.
+ */
+static void
+drop_noticed(struct page_list *drop, int all)
+{
+	unsigned long pgno;
+	struct msi_page *pg;
+	char *buf;
+
+	buf = malloc(pg_size);
+	if (buf == NULL)
+		errExit("malloc");
+	for (unsigned long i = 0; i < (all ? num_pages : drop->n); i++) {
+		pgno = all ? i : drop->pages[i];
+		pg = &pages[pgno];
+		lock_page(pgno);
+		wait_idle(pgno);
+		if (pg->state == MSI_MODIFIED) {
+			flush_page(pgno, buf);
+			pthread_mutex_lock(&lrc_lock);
+			list_add(&flushed, pgno);
+			pthread_mutex_unlock(&lrc_lock);
+		}
+		if (pg->state != MSI_INVALID) {
+			drop_page(pgno, region + pgno * pg_size);
+			pg->state = MSI_INVALID;
+			prof_inval(pgno);
+		}
+		unlock_page(pgno);
+	}
+	free(buf);
+}
+
+/* Collect the write notices of the intervals we have not seen from every
+ * node whose interval count in upto is past what we have seen of it, or
+ * from every node if upto is NULL, and drop the pages they name along
+ * with those already in drop. Called with sync_lock held.
+ */
+static void
+pull_notices(const uint32_t *upto, struct page_list *drop, int all)
+{
+	struct msi_msg msg;
+
+	pthread_mutex_lock(&lrc_lock);
+	notices_due = 0;
+	notice_all = 0;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_ACQUIRE;
+	msg.requester = self_id;
+	for (int j = 0; j < num_nodes; j++) {
+		if (j == self_id || (upto && upto[j] <= seen[j]))
+			continue;
+		msg.base = seen[j];
+		send_msg(j, &msg, NULL);
+		notices_due++;
+	}
+	while (notices_due > 0)
+		pthread_cond_wait(&lrc_cond, &lrc_lock);
+	list_move(drop, &noticed);
+	all |= notice_all;
+	pthread_mutex_unlock(&lrc_lock);
+
+	drop_noticed(drop, all);
+}
+
+void
+dsm_release(void)
+{
+	unsigned long t = lat_now();
+
+	release();
+	trace_sync(TRACE_RELEASE, 0, t);
+}
+
+void
+dsm_acquire(void)
+{
+	struct page_list drop = { 0 };
+	unsigned long t = lat_now();
+
+	if (lrc_on) {
+		pthread_mutex_lock(&sync_lock);
+		pull_notices(NULL, &drop, 0);
+		pthread_mutex_unlock(&sync_lock);
+		free(drop.pages);
+	}
+	trace_sync(TRACE_ACQUIRE, 0, t);
+}
+
+/* Bring what this node has seen up to the releases before a grant: drop
+ * the pages of the granting node's intervals it sent along, and ask the
+ * nodes whose intervals it has seen more of than we have for theirs.
+ */
+static void
+apply_grant(struct lock_state *lk)
+{
+	struct page_list drop = { 0 };
+	size_t vec = num_nodes * sizeof(uint32_t);
+	uint32_t upto[MAX_NODES];
+	uint64_t page;
+
+	memcpy(upto, lk->grant, vec);
+	for (size_t off = vec; off < lk->grant_len; off += sizeof(page)) {
+		memcpy(&page, lk->grant + off, sizeof(page));
+		if (page >= num_pages) {
+			fprintf(stderr, "Bad page %lu from node %d\n",
+				(unsigned long) page, lk->grant_src);
+			exit(EXIT_FAILURE);
+		}
+		list_add(&drop, page);
+	}
+
+	pthread_mutex_lock(&sync_lock);
+	pthread_mutex_lock(&lrc_lock);
+	if (upto[lk->grant_src] > seen[lk->grant_src])
+		seen[lk->grant_src] = upto[lk->grant_src];
+	pthread_mutex_unlock(&lrc_lock);
+	pull_notices(upto, &drop, lk->grant_all);
+	pthread_mutex_unlock(&sync_lock);
+	free(drop.pages);
+}
+
+static struct lock_state *
+get_lock(unsigned int lock)
+{
+	if (lock >= DSM_LOCKS) {
+		fprintf(stderr, "No lock %u\n", lock);
+		exit(EXIT_FAILURE);
+	}
+	return &locks[lock];
+}
+
+static void
+take_lock(unsigned int lock)
+{
+	struct lock_state *lk = get_lock(lock);
+	uint32_t my_seen[MAX_NODES];
+	struct msi_msg msg;
+
+	pthread_mutex_lock(&lk->local);
+	pthread_mutex_lock(&sync_state_lock);
+
+	/* Nobody asked for it since we had it last */
+	if (lk->token) {
+		lk->held = 1;
+		pthread_mutex_unlock(&sync_state_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&lrc_lock);
+	memcpy(my_seen, seen, sizeof(my_seen));
+	my_seen[self_id] = interval;
+	pthread_mutex_unlock(&lrc_lock);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_LOCK_REQ;
+	msg.requester = self_id;
+	msg.page = lock;
+	msg.len = num_nodes * sizeof(uint32_t);
+	send_msg(lock_home(lock), &msg, (const char *) my_seen);
+
+	while (lk->grant == NULL)
+		pthread_cond_wait(&sync_cond, &sync_state_lock);
+	pthread_mutex_unlock(&sync_state_lock);
+
+	if (lrc_on)
+		apply_grant(lk);
+	free(lk->grant);
+	lk->grant = NULL;
+}
+
+void
+dsm_lock(unsigned int lock)
+{
+	unsigned long t = lat_now();
+
+	take_lock(lock);
+	trace_sync(TRACE_LOCK, lock, t);
+}
+
+void
+dsm_unlock(unsigned int lock)
+{
+	struct lock_state *lk = get_lock(lock);
+	unsigned long t = lat_now();
+
+	release();
+
+	pthread_mutex_lock(&sync_state_lock);
+	lk->held = 0;
+	if (lk->next != -1) {
+		pass_lock(lock, lk->next, lk->next_seen);
+		free(lk->next_seen);
+		lk->next_seen = NULL;
+		lk->next = -1;
+	}
+	pthread_mutex_unlock(&sync_state_lock);
+	pthread_mutex_unlock(&lk->local);
+	trace_sync(TRACE_UNLOCK, lock, t);
+}
+
+/* Wait at node 0 until every node has come, and fill in upto with how
+ * many intervals each had released by then.
+ */
+static void
+barrier_wait(uint32_t *upto)
+{
+	struct msi_msg msg;
+	unsigned long gen;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_BARRIER;
+	msg.requester = self_id;
+	pthread_mutex_lock(&lrc_lock);
+	msg.version = interval;
+	pthread_mutex_unlock(&lrc_lock);
+
+	pthread_mutex_lock(&sync_state_lock);
+	gen = barrier_gen;
+	send_msg(0, &msg, NULL);
+	while (barrier_gen == gen)
+		pthread_cond_wait(&sync_cond, &sync_state_lock);
+	memcpy(upto, barrier_at, num_nodes * sizeof(*upto));
+	pthread_mutex_unlock(&sync_state_lock);
+}
+
+void
+dsm_barrier(void)
+{
+	uint32_t upto[MAX_NODES];
+	struct page_list drop = { 0 };
+	unsigned long t = lat_now();
+
+	release();
+	barrier_wait(upto);
+
+	/* Only nodes that released since we last heard from them are asked */
+	if (lrc_on) {
+		pthread_mutex_lock(&sync_lock);
+		pull_notices(upto, &drop, 0);
+		pthread_mutex_unlock(&sync_lock);
+		free(drop.pages);
+	}
+	trace_sync(TRACE_BARRIER, 0, t);
+}
+
+/* The last word between the nodes. Past the barrier nobody asks anything
+ * of anybody, not even the write notices a barrier normally collects, so
+ * the others may hang up at will. Sends are queued, though, so wait for
+ * the last ones, such as the manager's word to leave, to be written.
+ */
+void
+msi_shutdown(void)
+{
+	uint32_t upto[MAX_NODES];
+	struct mbox *mb;
+
+	__atomic_store_n(&closing, 1, __ATOMIC_RELEASE);
+	barrier_wait(upto);
+
+	for (int i = 0; i < num_nodes; i++) {
+		if (i == self_id)
+			continue;
+		mb = &mbox[i];
+		pthread_mutex_lock(&mb->lock);
+		while (mb->head || mb->taken || tx_busy[i])
+			pthread_cond_wait(&mb->idle, &mb->lock);
+		pthread_mutex_unlock(&mb->lock);
+
+		for (int k = 0; k < DSM_DATA_LANES; k++) {
+			mb = &lanes[i][k].mbox;
+			pthread_mutex_lock(&mb->lock);
+			while (mb->head || mb->taken)
+				pthread_cond_wait(&mb->idle, &mb->lock);
+			pthread_mutex_unlock(&mb->lock);
+		}
+	}
+}
@@ -0,0 +1,133 @@
+/* dsm_prefetch.c
+
+   Detection of sequential and strided fault streams. Faults are grouped
+   by the thread that took them. A thread's first fault is taken to start
+   a forward scan and the next few granules are fetched at once; after
+   that, a fault a whole number of strides on continues the stream and
+   the granules it is going to touch next are fetched ahead of it, while
+   any other fault starts a new stream with that stride and fetches
+   nothing. The window grows while the stream keeps consuming what was
+   fetched and shrinks when the stream breaks off and leaves prefetched
+   granules unused.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsm.h"
+
+#define NSTREAMS 64		/* Threads tracked at the same time */
+#define PF_MIN 2		/* Window of a newly detected stream */
+
+struct stream {
+	pid_t tid;		/* Faulting thread, 0 if the slot is free */
+	long last;		/* Last granule the thread faulted on */
+	long stride;		/* Distance between its faults, in granules */
+	long frontier;		/* Next granule that has not been prefetched */
+	int window;		/* Granules to keep fetched ahead */
+	int write;		/* The stream writes */
+};
+
+static struct stream streams[NSTREAMS];
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static int max_window;
+static long num_granules;
+static unsigned long pf_issued;	/* Granules prefetched */
+static unsigned long pf_used;	/* ... that the stream went on to use */
+
+void
+prefetch_init(int window, unsigned long npages)
+{
+	max_window = window;
+	num_granules = npages;
+}
+
+/* Grow the window while prefetches are used and shrink it otherwise.
+ */
+static void
+adapt(struct stream *s, int used, int wasted)
+{
+	pf_used += used;
+	if (wasted > 0)
+		s->window = s->window / 2 > PF_MIN ? s->window / 2 : PF_MIN;
+	else if (used > 0)
+		s->window = s->window * 2 < max_window ? s->window * 2 : max_window;
+}
+
+int
+prefetch_fault(pid_t tid, unsigned long pgno, int write, unsigned long *out)
+{
+	struct stream *s;
+	long p = pgno, d, k, ahead, end, n = 0;
+
+	if (max_window == 0)
+		return 0;
+
+	pthread_mutex_lock(&stream_lock);
+	s = &streams[(unsigned) tid % NSTREAMS];
+
+	if (s->tid != tid) {
+		/* A new thread. Guess that it scans forward; if it does not,
+		 * its next fault turns prefetching off again.
+		 */
+		s->tid = tid;
+		s->stride = 1;
+		s->window = PF_MIN;
+		s->frontier = p + 1;
+	} else {
+		d = p - s->last;
+		if (d == 0) {
+			pthread_mutex_unlock(&stream_lock);
+			return 0;
+		}
+
+		/* Granules from the last fault up to the frontier were
+		 * fetched. A fault on one of them, a whole number of strides
+		 * on, continues the stream, and the granules it stepped over
+		 * were used without faulting.
+		 */
+		ahead = (s->frontier - s->last) / s->stride;
+		k = d / s->stride;
+		if (d % s->stride != 0 || k <= 0 || k > ahead) {
+			if (ahead > 1)
+				adapt(s, 0, ahead - 1);
+			s->stride = d;
+			s->last = p;
+			s->frontier = p + d;
+			s->write = write;
+			pthread_mutex_unlock(&stream_lock);
+			return 0;
+		}
+		adapt(s, k - 1, 0);
+		if (k == ahead)
+			s->frontier = p + s->stride;
+	}
+	s->last = p;
+	s->write = write;
+
+	end = p + s->window * s->stride;
+	for (p = s->frontier; s->stride > 0 ? p <= end : p >= end; p += s->stride) {
+		if (p < 0 || p >= num_granules)
+			break;
+		out[n++] = p;
+	}
+	s->frontier = p;
+	pf_issued += n;
+	pthread_mutex_unlock(&stream_lock);
+
+	return n;
+}
+
+void
+prefetch_stats(unsigned long *issued, unsigned long *used)
+{
+	pthread_mutex_lock(&stream_lock);
+	*issued = pf_issued;
+	*used = pf_used;
+	pthread_mutex_unlock(&stream_lock);
+}
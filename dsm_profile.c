@@ -0,0 +1,126 @@
+/* dsm_profile.c
+
+   Per-page counters for finding the pages that bounce between nodes:
+   faults, invalidations, transfers of the page's writes and payload
+   bytes received. Every fault also samples where in the page it hit, as
+   one of PROF_SLICES slices, separately for reads and writes. Counters
+   are added to atomically from the fault handlers and the coherence
+   engine and cost one test when profiling is off.
+
+   Each node writes its own table with prof_write(); prof_report merges
+   the tables of all nodes. Pages several nodes fault on while writing
+   only slices the others never touch are falsely shared, and the fix is
+   in the data layout.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dsm.h"
+
+struct prof_page {
+	uint32_t faults;
+	uint32_t write_faults;
+	uint32_t invals;	/* Copies dropped for other nodes */
+	uint32_t transfers;	/* Write permission gained, or flushes */
+	uint64_t bytes;		/* Page payload received */
+	uint64_t read_slices;	/* Slices read faults hit */
+	uint64_t write_slices;	/* ... and write faults */
+};
+
+static struct prof_page *prof;	/* NULL while profiling is off */
+static unsigned long prof_pages;
+static unsigned long prof_granule;
+static int prof_self;
+
+void
+prof_init(int self, unsigned long npages, unsigned long granule)
+{
+	prof = calloc(npages, sizeof(*prof));
+	if (prof == NULL)
+		errExit("calloc");
+	prof_pages = npages;
+	prof_granule = granule;
+	prof_self = self;
+}
+
+static void
+add32(uint32_t *counter, uint32_t n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+void
+prof_fault(unsigned long pgno, unsigned long off, int write)
+{
+	uint64_t bit;
+
+	if (prof == NULL || pgno >= prof_pages)
+		return;
+	bit = 1UL << (off * PROF_SLICES / prof_granule);
+	add32(&prof[pgno].faults, 1);
+	if (write) {
+		add32(&prof[pgno].write_faults, 1);
+		__atomic_or_fetch(&prof[pgno].write_slices, bit,
+				  __ATOMIC_RELAXED);
+	} else {
+		__atomic_or_fetch(&prof[pgno].read_slices, bit,
+				  __ATOMIC_RELAXED);
+	}
+}
+
+void
+prof_inval(unsigned long pgno)
+{
+	if (prof != NULL)
+		add32(&prof[pgno].invals, 1);
+}
+
+void
+prof_transfer(unsigned long pgno)
+{
+	if (prof != NULL)
+		add32(&prof[pgno].transfers, 1);
+}
+
+void
+prof_bytes(unsigned long pgno, unsigned long n)
+{
+	if (prof != NULL)
+		__atomic_add_fetch(&prof[pgno].bytes, n, __ATOMIC_RELAXED);
+}
+
+void
+prof_write(FILE *f)
+{
+	struct prof_page p;
+
+	if (prof == NULL)
+		return;
+	fprintf(f, "dsm-profile node %d pages %lu granule %lu\n", prof_self,
+		prof_pages, prof_granule);
+	for (unsigned long i = 0; i < prof_pages; i++) {
+		p.faults = __atomic_load_n(&prof[i].faults, __ATOMIC_RELAXED);
+		p.write_faults = __atomic_load_n(&prof[i].write_faults,
+						 __ATOMIC_RELAXED);
+		p.invals = __atomic_load_n(&prof[i].invals, __ATOMIC_RELAXED);
+		p.transfers = __atomic_load_n(&prof[i].transfers,
+					      __ATOMIC_RELAXED);
+		p.bytes = __atomic_load_n(&prof[i].bytes, __ATOMIC_RELAXED);
+		p.read_slices = __atomic_load_n(&prof[i].read_slices,
+						__ATOMIC_RELAXED);
+		p.write_slices = __atomic_load_n(&prof[i].write_slices,
+						 __ATOMIC_RELAXED);
+		if (p.faults == 0 && p.invals == 0 && p.transfers == 0 &&
+		    p.bytes == 0)
+			continue;
+		fprintf(f, "%lu %u %u %u %u %lu %016lx %016lx\n", i, p.faults,
+			p.write_faults, p.invals, p.transfers,
+			(unsigned long) p.bytes, (unsigned long) p.read_slices,
+			(unsigned long) p.write_slices);
+	}
+}
@@ -0,0 +1,122 @@
+/* dsm_reactor.c
+
+   A single event loop over every file descriptor the runtime reads: the
+   userfaultfd, the peer connections and the self mailbox. Handlers run
+   on the reactor thread and must not block; anything that waits, such as
+   resolving a fault, is handed to other threads. With the io_uring
+   transport the ring takes the place of epoll.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include "dsm.h"
+
+#define MAX_EVENTS 64		/* Events taken by one epoll_wait() */
+
+struct watch {
+	int fd;
+	reactor_fn fn;
+	void *arg;
+};
+
+static const char *transport_names[] = {
+	[DSM_SOCKETS] = "sockets",
+	[DSM_URING] = "uring",
+};
+
+static int epfd = -1;
+static int use_uring = -1;
+
+static void *
+reactor_thread(void *arg)
+{
+	struct epoll_event ev[MAX_EVENTS];
+	struct watch *w;
+	int n;
+
+	for (;;) {
+		n = epoll_wait(epfd, ev, MAX_EVENTS, -1);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			errExit("epoll_wait");
+		for (int i = 0; i < n; i++) {
+			w = ev[i].data.ptr;
+			w->fn(w->fd, w->arg);
+		}
+	}
+	return NULL;
+}
+
+int
+reactor_transport(const char *name)
+{
+	for (int i = 0; i < (int) (sizeof(transport_names) / sizeof(transport_names[0])); i++)
+		if (strcmp(name, transport_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+const char *
+reactor_transport_name(int transport)
+{
+	return transport_names[transport];
+}
+
+void
+reactor_init(int transport)
+{
+	pthread_t thr;
+	int s;
+
+	if (use_uring != -1)
+		return;
+	use_uring = transport == DSM_URING;
+	if (use_uring) {
+		uring_init();
+		return;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		errExit("epoll_create1");
+
+	s = pthread_create(&thr, NULL, reactor_thread, NULL);
+	if (s != 0) {
+		errno = s;
+		errExit("pthread_create");
+	}
+}
+
+void
+reactor_add(int fd, reactor_fn fn, void *arg)
+{
+	struct epoll_event ev;
+	struct watch *w;
+
+	if (use_uring) {
+		uring_poll(fd, fn, arg);
+		return;
+	}
+
+	w = malloc(sizeof(*w));
+	if (w == NULL)
+		errExit("malloc");
+	w->fd = fd;
+	w->fn = fn;
+	w->arg = arg;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = w;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		errExit("epoll_ctl");
+}
@@ -0,0 +1,194 @@
+/* dsm_region.c
+
+   Mapping of the shared region and its registration with userfaultfd.
+   The region is anonymous memory in base pages, or 2 MB huge pages from
+   hugetlbfs, either anonymous or through a memfd.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <linux/userfaultfd.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+#include "dsm.h"
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+static const char *backing_names[] = {
+	[DSM_ANON] = "anon",
+	[DSM_HUGETLB] = "hugetlb",
+	[DSM_MEMFD] = "memfd",
+};
+
+int
+region_backing(const char *name)
+{
+	for (int i = 0; i < (int) (sizeof(backing_names) / sizeof(backing_names[0])); i++)
+		if (strcmp(name, backing_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+const char *
+region_backing_name(int backing)
+{
+	return backing_names[backing];
+}
+
+/* Parse a granule such as "4096", "64k" or "2m".
+ */
+unsigned long
+region_parse_size(const char *s)
+{
+	char *end;
+	unsigned long n = strtoul(s, &end, 0);
+
+	if (*end == 'k' || *end == 'K')
+		n <<= 10;
+	else if (*end == 'm' || *end == 'M')
+		n <<= 20;
+	return n;
+}
+
+/* Map anonymous memory aligned to the granule, so that granules can be
+ * found by rounding fault addresses down. Huge page mappings are aligned
+ * by the kernel. An address given is taken as it is.
+ */
+static char *
+map_aligned(char *hint, unsigned long len, unsigned long align)
+{
+	char *p, *q;
+	int fixed = hint ? MAP_FIXED_NOREPLACE : 0;
+
+	p = mmap(hint, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | fixed, -1, 0);
+	if (p == MAP_FAILED || hint != NULL ||
+	    ((unsigned long) p & (align - 1)) == 0)
+		return p;
+	munmap(p, len);
+
+	p = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+	q = (char *) (((unsigned long) p + align - 1) & ~(align - 1));
+	if (q > p)
+		munmap(p, q - p);
+	munmap(q + len, p + align - q);
+	return q;
+}
+
+void
+region_create(struct dsm_region *r, char *hint)
+{
+	struct uffdio_api uffdio_api;
+	struct uffdio_register uffdio_register;
+	unsigned long page_size = sysconf(_SC_PAGE_SIZE);
+	int fixed = hint ? MAP_FIXED_NOREPLACE : 0;
+
+	/* Huge pages are transferred whole; a base-page region may use any
+	 * power-of-two multiple of the page size.
+	 */
+	if (r->backing != DSM_ANON)
+		r->granule = HUGE_PAGE_SIZE;
+	if (r->granule == 0)
+		r->granule = page_size;
+	if (r->granule < page_size || (r->granule & (r->granule - 1))) {
+		fprintf(stderr, "Granule must be a power of two of at least %lu\n",
+			page_size);
+		exit(EXIT_FAILURE);
+	}
+	r->len = (r->len + r->granule - 1) & ~(r->granule - 1);
+
+	/* Create userfaultfd object and enable it. Write-protect faults are
+	 * needed to notice the first write to a Shared copy, the ID of the
+	 * faulting thread to follow its access pattern, and the exact
+	 * address for the profile of where in a page faults hit.
+	 */
+	r->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (r->uffd == -1)
+		errExit("userfaultfd");
+
+	uffdio_api.api = UFFD_API;
+	uffdio_api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP |
+		UFFD_FEATURE_THREAD_ID | UFFD_FEATURE_EXACT_ADDRESS;
+	if (r->backing != DSM_ANON)
+		uffdio_api.features |= UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
+	if (ioctl(r->uffd, UFFDIO_API, &uffdio_api) == -1)
+		errExit("ioctl-UFFDIO_API");
+
+	/* The memory is not allocated by default, but when we touch it via
+	 * the userfaultfd.
+	 */
+	r->fd = -1;
+	switch (r->backing) {
+	case DSM_ANON:
+		r->base = map_aligned(hint, r->len, r->granule);
+		break;
+	case DSM_HUGETLB:
+		r->base = mmap(hint, r->len, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | fixed,
+			       -1, 0);
+		break;
+	case DSM_MEMFD:
+		r->fd = memfd_create("dsm", MFD_CLOEXEC | MFD_HUGETLB);
+		if (r->fd == -1)
+			errExit("memfd_create");
+		if (ftruncate(r->fd, r->len) == -1)
+			errExit("ftruncate");
+		r->base = mmap(hint, r->len, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | fixed, r->fd, 0);
+		break;
+	default:
+		fprintf(stderr, "Unknown backing %d\n", r->backing);
+		exit(EXIT_FAILURE);
+	}
+	if (r->base == MAP_FAILED)
+		errExit("mmap");
+
+	/* Pointers into the region, such as those dsm_malloc() hands out,
+	 * only mean the same on every node if it is at the same address.
+	 * Kernels before 4.17 take MAP_FIXED_NOREPLACE as a mere hint.
+	 */
+	if (hint != NULL && r->base != hint) {
+		fprintf(stderr, "Cannot map the region at %p\n", hint);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Track missing pages, and writes to write-protected pages so that
+	 * Shared copies can be upgraded.
+	 */
+	uffdio_register.range.start = (unsigned long) r->base;
+	uffdio_register.range.len = r->len;
+	uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING |
+		UFFDIO_REGISTER_MODE_WP;
+	if (ioctl(r->uffd, UFFDIO_REGISTER, &uffdio_register) == -1)
+		errExit("ioctl-UFFDIO_REGISTER");
+}
+
+/* Throw away the local contents of [off, off + len) so that the next
+ * access faults again. A shared memfd keeps its pages in the page cache,
+ * so they have to be punched out of the file.
+ */
+void
+region_drop(struct dsm_region *r, unsigned long off, unsigned long len)
+{
+	if (r->backing == DSM_MEMFD) {
+		if (fallocate(r->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      off, len) == -1)
+			errExit("fallocate");
+		return;
+	}
+
+	if (madvise(r->base + off, len, MADV_DONTNEED) == -1)
+		errExit("madvise");
+}
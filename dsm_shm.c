@@ -0,0 +1,479 @@
+/* dsm_shm.c
+
+   Links between nodes on the same host. When two nodes find in their
+   TCP handshake that they run under the same kernel, the one with the
+   higher ID creates a memfd with a ring for each direction and hands it
+   to the other over a Unix socket, along with an eventfd for each side.
+   Their messages then go through the rings instead of TCP: a message is
+   copied into the ring straight from where the sending thread has it
+   and handled in place by the receiver. Only while the ring is full, or
+   messages are already queued in front of it, does it wait in the
+   sender's mailbox and get copied twice.
+
+   Each ring has one writer at a time, the sending thread or the sending
+   node's sender thread, and one reader, the receiving node's reactor.
+   They share no lock, only the count of bytes each has gone through. A
+   reader that runs out of records says it is going to sleep and waits on
+   its eventfd, which the writer signals only then; a writer that runs out
+   of room sleeps on a futex that the reader wakes only then. So a busy
+   link takes no system calls at all.
+
+   The Unix socket lives in the abstract namespace under a name made up
+   for the handshake, so nodes in different network namespaces, as
+   containers often are, cannot reach it and stay on TCP.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "dsm.h"
+
+#define RING_HDR 4096		/* Ring counters, ahead of its data */
+#define RING_MASK (SHM_RING_BYTES - 1)
+#define REC_ALIGN 64		/* Records start on a cache line */
+#define REC_PAD UINT64_MAX	/* Record length: skip to the next lap */
+#define BOOT_ID "/proc/sys/kernel/random/boot_id"
+
+/* One direction of a link. Each counter sits on the cache line of the
+ * node that advances it.
+ */
+struct shm_ring {
+	/* Writer */
+	uint64_t tail;		/* Bytes written */
+	uint32_t full;		/* The writer sleeps until the reader reads */
+	char pad1[REC_ALIGN - 12];
+
+	/* Reader */
+	uint64_t head;		/* Bytes read */
+	uint32_t sleeping;	/* The reader waits for its eventfd */
+	char pad2[REC_ALIGN - 12];
+};
+
+struct shm_link {
+	struct shm_ring *tx, *rx;
+	char *tx_data, *rx_data;
+	int tx_efd;		/* Wakes the other node */
+	int rx_efd;		/* Wakes us */
+	uint64_t tail;		/* Bytes written to tx, maybe not published */
+	uint64_t head;		/* Bytes read from rx, maybe not published */
+};
+
+/* What each node tells a peer with a higher ID once connected.
+ */
+struct shm_hello {
+	char boot_id[40];	/* Of our kernel, empty if unknown */
+	uint64_t nonce;		/* Names our Unix socket, 0 if we offer none */
+};
+
+static int shm_on = 1;
+static struct shm_link *links[MAX_NODES];
+
+void
+shm_set(int on)
+{
+	shm_on = on;
+}
+
+struct shm_link *
+shm_link(int node)
+{
+	return links[node];
+}
+
+int
+shm_fd(struct shm_link *l)
+{
+	return l->rx_efd;
+}
+
+static size_t
+rec_size(size_t len)
+{
+	return (sizeof(uint64_t) + len + REC_ALIGN - 1) & ~(size_t) (REC_ALIGN - 1);
+}
+
+static void
+futex(uint32_t *addr, int op, uint32_t val)
+{
+	if (syscall(SYS_futex, addr, op, val, NULL, NULL, 0) == -1 &&
+	    errno != EAGAIN && errno != EINTR)
+		errExit("futex");
+}
+
+void
+shm_push(struct shm_link *l)
+{
+	if (__atomic_load_n(&l->tx->tail, __ATOMIC_RELAXED) == l->tail)
+		return;
+	__atomic_store_n(&l->tx->tail, l->tail, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&l->tx->sleeping, 0, __ATOMIC_SEQ_CST) &&
+	    eventfd_write(l->tx_efd, 1) == -1)
+		errExit("eventfd_write");
+}
+
+/* Whether len bytes past what we wrote are free.
+ */
+static int
+room(struct shm_link *l, size_t len)
+{
+	uint64_t head = __atomic_load_n(&l->tx->head, __ATOMIC_ACQUIRE);
+
+	return SHM_RING_BYTES - (l->tail - head) >= len;
+}
+
+/* Wait until len bytes past what we wrote are free.
+ */
+static void
+wait_room(struct shm_link *l, size_t len)
+{
+	uint64_t head;
+
+	for (;;) {
+		if (room(l, len))
+			return;
+
+		/* Let the reader have what is there, then sleep unless it
+		 * made room in the meantime.
+		 */
+		shm_push(l);
+		__atomic_store_n(&l->tx->full, 1, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&l->tx->head, __ATOMIC_SEQ_CST);
+		if (SHM_RING_BYTES - (l->tail - head) >= len) {
+			__atomic_store_n(&l->tx->full, 0, __ATOMIC_RELAXED);
+			return;
+		}
+		futex(&l->tx->full, FUTEX_WAIT, 1);
+	}
+}
+
+/* Room a record of len bytes takes at the tail, counting the padding
+ * that takes it to the start of the ring if it does not fit before the
+ * end; a record is never split.
+ */
+static size_t
+room_for(struct shm_link *l, size_t len)
+{
+	size_t need = rec_size(len);
+	size_t to_end = SHM_RING_BYTES - (l->tail & RING_MASK);
+
+	return need <= to_end ? need : to_end + need;
+}
+
+static void
+put(struct shm_link *l, const void *hdr, size_t hlen, const void *data,
+    size_t dlen)
+{
+	size_t need = rec_size(hlen + dlen);
+	size_t to_end = SHM_RING_BYTES - (l->tail & RING_MASK);
+	char *p;
+
+	if (need > to_end) {
+		*(uint64_t *) (l->tx_data + (l->tail & RING_MASK)) = REC_PAD;
+		l->tail += to_end;
+	}
+	p = l->tx_data + (l->tail & RING_MASK);
+	*(uint64_t *) p = hlen + dlen;
+	memcpy(p + sizeof(uint64_t), hdr, hlen);
+	if (dlen > 0)
+		memcpy(p + sizeof(uint64_t) + hlen, data, dlen);
+	l->tail += need;
+}
+
+void
+shm_put(struct shm_link *l, const void *hdr, size_t hlen, const void *data,
+	size_t dlen)
+{
+	wait_room(l, room_for(l, hlen + dlen));
+	put(l, hdr, hlen, data, dlen);
+}
+
+int
+shm_try_put(struct shm_link *l, const void *hdr, size_t hlen,
+	    const void *data, size_t dlen)
+{
+	if (!room(l, room_for(l, hlen + dlen)))
+		return 0;
+	put(l, hdr, hlen, data, dlen);
+	return 1;
+}
+
+const char *
+shm_next(struct shm_link *l, size_t *len)
+{
+	uint64_t tail = __atomic_load_n(&l->rx->tail, __ATOMIC_ACQUIRE);
+	const char *p;
+
+	while (l->head != tail) {
+		p = l->rx_data + (l->head & RING_MASK);
+		if (*(const uint64_t *) p == REC_PAD) {
+			l->head += SHM_RING_BYTES - (l->head & RING_MASK);
+			continue;
+		}
+		*len = *(const uint64_t *) p;
+		if (*len > SHM_MAX_RECORD) {
+			fprintf(stderr, "Bad record of %zu bytes in ring\n", *len);
+			exit(EXIT_FAILURE);
+		}
+		return p + sizeof(uint64_t);
+	}
+	return NULL;
+}
+
+void
+shm_done(struct shm_link *l, size_t len)
+{
+	l->head += rec_size(len);
+	__atomic_store_n(&l->rx->head, l->head, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&l->rx->full, 0, __ATOMIC_SEQ_CST))
+		futex(&l->rx->full, FUTEX_WAKE, 1);
+}
+
+int
+shm_sleep(struct shm_link *l)
+{
+	__atomic_store_n(&l->rx->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&l->rx->tail, __ATOMIC_SEQ_CST) == l->head)
+		return 1;
+	__atomic_store_n(&l->rx->sleeping, 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void
+read_full(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			errExit("read");
+		buf = (char *) buf + n;
+		len -= n;
+	}
+}
+
+static void
+rendezvous(struct sockaddr_un *sun, socklen_t *len, uint64_t nonce)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	*len = offsetof(struct sockaddr_un, sun_path) + 1 +
+		snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1,
+			 "dsm-%016lx", (unsigned long) nonce);
+}
+
+/* Map the rings of a memfd. The node with the lower ID writes ring 0
+ * and reads ring 1, the other the other way round; efd[k] wakes the
+ * reader of ring k.
+ */
+static struct shm_link *
+attach(int mfd, int low, const int *efd)
+{
+	struct shm_link *l;
+	char *p;
+
+	p = mmap(NULL, 2 * (RING_HDR + SHM_RING_BYTES), PROT_READ | PROT_WRITE,
+		 MAP_SHARED, mfd, 0);
+	if (p == MAP_FAILED)
+		errExit("mmap");
+	l = calloc(1, sizeof(*l));
+	if (l == NULL)
+		errExit("calloc");
+	l->tx = (struct shm_ring *) (low ? p : p + RING_HDR + SHM_RING_BYTES);
+	l->rx = (struct shm_ring *) (low ? p + RING_HDR + SHM_RING_BYTES : p);
+	l->tx_data = (char *) l->tx + RING_HDR;
+	l->rx_data = (char *) l->rx + RING_HDR;
+	l->tx_efd = efd[!low];
+	l->rx_efd = efd[low];
+	return l;
+}
+
+/* Create the rings to share with the lower node that listens at nonce
+ * and hand them over. Returns NULL if the node cannot be reached.
+ */
+static struct shm_link *
+offer(int self, uint64_t nonce)
+{
+	struct sockaddr_un sun;
+	struct shm_link *l;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	socklen_t len;
+	int fds[3], s;
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s == -1)
+		errExit("socket");
+	rendezvous(&sun, &len, nonce);
+	if (connect(s, (struct sockaddr *) &sun, len) == -1) {
+		close(s);
+		return NULL;
+	}
+
+	fds[0] = memfd_create("dsm-ring", MFD_CLOEXEC);
+	if (fds[0] == -1)
+		errExit("memfd_create");
+	if (ftruncate(fds[0], 2 * (RING_HDR + SHM_RING_BYTES)) == -1)
+		errExit("ftruncate");
+	fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fds[1] == -1 || fds[2] == -1)
+		errExit("eventfd");
+
+	/* Nobody has read anything yet: the first record wakes the reader */
+	l = attach(fds[0], 0, fds + 1);
+	l->tx->sleeping = 1;
+	l->rx->sleeping = 1;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &self;
+	iov.iov_len = sizeof(self);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if (sendmsg(s, &mh, 0) != sizeof(self))
+		errExit("sendmsg");
+	close(s);
+	close(fds[0]);
+	return l;
+}
+
+/* Take the rings some higher node offers on our listening socket.
+ */
+static void
+take(int lfd, int self, int nnodes)
+{
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	int fds[3], id, s;
+
+	s = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (s == -1)
+		errExit("accept");
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &id;
+	iov.iov_len = sizeof(id);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	if (recvmsg(s, &mh, MSG_CMSG_CLOEXEC) != sizeof(id))
+		errExit("recvmsg");
+	cm = CMSG_FIRSTHDR(&mh);
+	if (cm == NULL || cm->cmsg_level != SOL_SOCKET ||
+	    cm->cmsg_type != SCM_RIGHTS ||
+	    cm->cmsg_len != CMSG_LEN(sizeof(fds)) || id <= self ||
+	    id >= nnodes || links[id] != NULL) {
+		fprintf(stderr, "Unexpected ring offer\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+	links[id] = attach(fds[0], 1, fds + 1);
+	close(fds[0]);
+	close(s);
+}
+
+/* Our hello, and the socket that higher nodes on this host reach us at.
+ */
+static int
+hello_init(struct shm_hello *h, int want)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+	ssize_t n;
+	int fd, lfd;
+
+	memset(h, 0, sizeof(*h));
+	fd = open(BOOT_ID, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	n = read(fd, h->boot_id, sizeof(h->boot_id) - 1);
+	close(fd);
+	if (n <= 0) {
+		h->boot_id[0] = '\0';
+		return -1;
+	}
+	if (!want)
+		return -1;
+
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd == -1)
+		errExit("socket");
+	if (getrandom(&h->nonce, sizeof(h->nonce), 0) != sizeof(h->nonce))
+		h->nonce = (uint64_t) getpid() << 32 ^ time(NULL);
+	h->nonce |= 1;
+	rendezvous(&sun, &len, h->nonce);
+	if (bind(lfd, (struct sockaddr *) &sun, len) == -1 ||
+	    listen(lfd, MAX_NODES) == -1) {
+		close(lfd);
+		h->nonce = 0;
+		return -1;
+	}
+	return lfd;
+}
+
+void
+shm_negotiate(int self, int nnodes, int *fd)
+{
+	struct shm_hello mine, theirs;
+	int lfd;
+	char ok;
+
+	lfd = hello_init(&mine, shm_on && self < nnodes - 1);
+
+	/* Every node first tells the higher ones about itself, then answers
+	 * the lower ones, then hears back from the higher ones; nobody
+	 * waits for a node that is waiting for it.
+	 */
+	for (int i = self + 1; i < nnodes; i++)
+		if (write(fd[i], &mine, sizeof(mine)) != sizeof(mine))
+			errExit("write");
+
+	for (int i = 0; i < self; i++) {
+		read_full(fd[i], &theirs, sizeof(theirs));
+		theirs.boot_id[sizeof(theirs.boot_id) - 1] = '\0';
+		if (shm_on && theirs.nonce != 0 && mine.boot_id[0] != '\0' &&
+		    strcmp(mine.boot_id, theirs.boot_id) == 0)
+			links[i] = offer(self, theirs.nonce);
+		ok = links[i] != NULL;
+		if (write(fd[i], &ok, 1) != 1)
+			errExit("write");
+	}
+
+	for (int i = self + 1; i < nnodes; i++) {
+		read_full(fd[i], &ok, 1);
+		if (ok)
+			take(lfd, self, nnodes);
+	}
+	if (lfd != -1)
+		close(lfd);
+}
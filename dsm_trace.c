@@ -0,0 +1,371 @@
+/* dsm_trace.c
+
+   Recording and replaying access traces. While recording, the fault
+   handlers log every fault and the synchronization calls log themselves,
+   each with when it began and ended, into a table that grows under a
+   lock: all of them already wait on other nodes, which dwarfs the cost.
+   Think times, the gaps between the end of one record of a thread and
+   the start of its next, are worked out when the trace is written.
+
+   Replaying runs a thread for every thread of the node in the trace,
+   which touches the same bytes and makes the same calls in the same
+   order, at full speed or sleeping through the think times.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "dsm.h"
+
+#define TRACE_MAGIC "DSMTRACE"
+#define TRACE_VERSION 1
+#define MIN_EVENTS 4096		/* First size of the recording table */
+#define LINE 64			/* Replayed reads touch a byte per line */
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t node;		/* Node that recorded it */
+	uint64_t pages;
+	uint64_t granule;
+	uint64_t records;	/* Records following the header */
+};
+
+/* A record while recording, with the thread's ID and times.
+ */
+struct event {
+	pid_t tid;
+	int op;
+	unsigned long page;
+	unsigned int offset;
+	unsigned int length;
+	unsigned long start;
+	unsigned long end;
+	unsigned long seq;	/* Keeps events that start together in order */
+};
+
+static struct event *events;
+static unsigned long num_events, max_events;
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static int recording;
+static int rec_self;
+static unsigned long rec_pages;
+static unsigned long rec_granule;
+
+/* A thread of the replay and its records.
+ */
+struct player {
+	pthread_t thr;
+	const struct trace *t;
+	char *base;
+	int timed;
+	struct trace_rec **rec;
+	unsigned long n;
+	unsigned long done;
+};
+
+void
+trace_record_start(int self, unsigned long npages, unsigned long granule)
+{
+	rec_self = self;
+	rec_pages = npages;
+	rec_granule = granule;
+	__atomic_store_n(&recording, 1, __ATOMIC_RELEASE);
+}
+
+static void
+add_event(pid_t tid, int op, unsigned long page, unsigned int offset,
+	  unsigned int length, unsigned long start, unsigned long end)
+{
+	struct event *e;
+
+	pthread_mutex_lock(&events_lock);
+	if (num_events == max_events) {
+		max_events = max_events ? 2 * max_events : MIN_EVENTS;
+		events = realloc(events, max_events * sizeof(*events));
+		if (events == NULL)
+			errExit("realloc");
+	}
+	e = &events[num_events];
+	e->tid = tid;
+	e->op = op;
+	e->page = page;
+	e->offset = offset;
+	e->length = length;
+	e->start = start;
+	e->end = end;
+	e->seq = num_events++;
+	pthread_mutex_unlock(&events_lock);
+}
+
+void
+trace_fault(pid_t tid, unsigned long pgno, unsigned long off, int write,
+	    unsigned long start, unsigned long end)
+{
+	if (__atomic_load_n(&recording, __ATOMIC_ACQUIRE))
+		add_event(tid, write ? TRACE_WRITE : TRACE_READ, pgno, off, 1,
+			  start, end);
+}
+
+void
+trace_sync(int op, unsigned int arg, unsigned long start)
+{
+	if (__atomic_load_n(&recording, __ATOMIC_ACQUIRE))
+		add_event(syscall(SYS_gettid), op, arg, 0, 0, start, lat_now());
+}
+
+static int
+cmp_start(const void *a, const void *b)
+{
+	const struct event *x = a, *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+void
+trace_write(FILE *f)
+{
+	struct trace_header h;
+	struct trace_rec r;
+	struct event *ev;
+	pid_t *tids;
+	unsigned long *last, n;
+	unsigned int nthreads = 0, i;
+
+	if (!__atomic_load_n(&recording, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&events_lock);
+	n = num_events;
+	ev = malloc((n ? n : 1) * sizeof(*ev));
+	if (ev == NULL)
+		errExit("malloc");
+	memcpy(ev, events, n * sizeof(*ev));
+	pthread_mutex_unlock(&events_lock);
+
+	/* Threads are numbered in the order they first show up */
+	qsort(ev, n, sizeof(*ev), cmp_start);
+	tids = malloc((n ? n : 1) * sizeof(*tids));
+	last = malloc((n ? n : 1) * sizeof(*last));
+	if (tids == NULL || last == NULL)
+		errExit("malloc");
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.version = TRACE_VERSION;
+	h.node = rec_self;
+	h.pages = rec_pages;
+	h.granule = rec_granule;
+	h.records = n;
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		errExit("fwrite");
+
+	for (unsigned long k = 0; k < n; k++) {
+		for (i = 0; i < nthreads && tids[i] != ev[k].tid; i++)
+			;
+		if (i == nthreads) {
+			tids[nthreads++] = ev[k].tid;
+			last[i] = ev[k].start;
+		}
+		memset(&r, 0, sizeof(r));
+		r.node = rec_self;
+		r.op = ev[k].op;
+		r.thread = i;
+		r.page = ev[k].page;
+		r.offset = ev[k].offset;
+		r.length = ev[k].length;
+		r.think_ns = ev[k].start > last[i] ? ev[k].start - last[i] : 0;
+		if (ev[k].end > last[i])
+			last[i] = ev[k].end;
+		if (fwrite(&r, sizeof(r), 1, f) != 1)
+			errExit("fwrite");
+	}
+	free(last);
+	free(tids);
+	free(ev);
+}
+
+static void
+bad_trace(const char *path, const char *why)
+{
+	fprintf(stderr, "%s: %s\n", path, why);
+	exit(EXIT_FAILURE);
+}
+
+void
+trace_load(const char *path, struct trace *t)
+{
+	struct trace_header h;
+	struct trace_rec *r;
+	unsigned long max = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		errExit(path);
+	memset(t, 0, sizeof(*t));
+
+	/* One header and its records for every node in the file */
+	while (fread(&h, sizeof(h), 1, f) == 1) {
+		if (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 ||
+		    h.version != TRACE_VERSION)
+			bad_trace(path, "not an access trace");
+		if (h.node >= MAX_NODES || h.pages == 0 || h.granule == 0)
+			bad_trace(path, "bad header");
+		if (t->pages == 0) {
+			t->pages = h.pages;
+			t->granule = h.granule;
+		} else if (h.pages != t->pages || h.granule != t->granule) {
+			bad_trace(path, "traces of different regions");
+		}
+		if ((int) h.node >= t->nnodes)
+			t->nnodes = h.node + 1;
+
+		if (t->n + h.records > max) {
+			max = t->n + h.records;
+			t->rec = realloc(t->rec, max * sizeof(*t->rec));
+			if (t->rec == NULL)
+				errExit("realloc");
+		}
+		if (fread(t->rec + t->n, sizeof(*t->rec), h.records, f) !=
+		    h.records)
+			bad_trace(path, "truncated");
+		for (unsigned long k = t->n; k < t->n + h.records; k++) {
+			r = &t->rec[k];
+			if (r->node != h.node || r->op >= TRACE_OPS)
+				bad_trace(path, "bad record");
+			if ((r->op == TRACE_READ || r->op == TRACE_WRITE) &&
+			    (r->page >= t->pages || r->length == 0 ||
+			     r->offset + (unsigned long) r->length > t->granule))
+				bad_trace(path, "access outside the region");
+			if ((r->op == TRACE_LOCK || r->op == TRACE_UNLOCK) &&
+			    r->page >= DSM_LOCKS)
+				bad_trace(path, "no such lock");
+		}
+		t->n += h.records;
+	}
+	if (ferror(f))
+		errExit(path);
+	if (t->pages == 0)
+		bad_trace(path, "empty");
+	fclose(f);
+}
+
+static void
+think(unsigned long ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000UL;
+	ts.tv_nsec = ns % 1000000000UL;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static void *
+player_thread(void *arg)
+{
+	struct player *p = arg;
+	struct trace_rec *r;
+	volatile char *at;
+
+	for (unsigned long k = 0; k < p->n; k++) {
+		r = p->rec[k];
+		if (p->timed && r->think_ns > 0)
+			think(r->think_ns);
+		at = p->base + r->page * p->t->granule + r->offset;
+		switch (r->op) {
+		case TRACE_READ:
+			for (unsigned int o = 0; o < r->length; o += LINE)
+				(void) at[o];
+			(void) at[r->length - 1];
+			break;
+		case TRACE_WRITE:
+			memset((char *) at, r->thread + 'A', r->length);
+			break;
+		case TRACE_ACQUIRE:
+			dsm_acquire();
+			break;
+		case TRACE_RELEASE:
+			dsm_release();
+			break;
+		case TRACE_LOCK:
+			dsm_lock(r->page);
+			break;
+		case TRACE_UNLOCK:
+			dsm_unlock(r->page);
+			break;
+		case TRACE_BARRIER:
+			dsm_barrier();
+			break;
+		}
+	}
+	p->done = p->n;
+	return NULL;
+}
+
+unsigned long
+trace_replay(const struct trace *t, char *base, int self, int timed)
+{
+	struct player *players, *p;
+	unsigned int nthreads = 0;
+	unsigned long done = 0;
+	int s;
+
+	for (unsigned long k = 0; k < t->n; k++)
+		if (t->rec[k].node == self && t->rec[k].thread >= nthreads)
+			nthreads = t->rec[k].thread + 1;
+	if (nthreads == 0)
+		return 0;
+	players = calloc(nthreads, sizeof(*players));
+	if (players == NULL)
+		errExit("calloc");
+
+	/* Hand every thread its records in trace order */
+	for (unsigned long k = 0; k < t->n; k++)
+		if (t->rec[k].node == self)
+			players[t->rec[k].thread].n++;
+	for (unsigned int i = 0; i < nthreads; i++) {
+		players[i].t = t;
+		players[i].base = base;
+		players[i].timed = timed;
+		players[i].rec = malloc((players[i].n ? players[i].n : 1) *
+					sizeof(*players[i].rec));
+		if (players[i].rec == NULL)
+			errExit("malloc");
+		players[i].n = 0;
+	}
+	for (unsigned long k = 0; k < t->n; k++) {
+		if (t->rec[k].node != self)
+			continue;
+		p = &players[t->rec[k].thread];
+		p->rec[p->n++] = &t->rec[k];
+	}
+
+	for (unsigned int i = 0; i < nthreads; i++) {
+		s = pthread_create(&players[i].thr, NULL, player_thread,
+				   &players[i]);
+		if (s != 0) {
+			errno = s;
+			errExit("pthread_create");
+		}
+	}
+	for (unsigned int i = 0; i < nthreads; i++) {
+		pthread_join(players[i].thr, NULL);
+		done += players[i].done;
+		free(players[i].rec);
+	}
+	free(players);
+	return done;
+}
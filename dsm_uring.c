@@ -0,0 +1,433 @@
+/* dsm_uring.c
+
+   io_uring transport. One ring carries everything the reactor would
+   otherwise do with epoll, recv() and writev(): multishot polls on the
+   userfaultfd and the self mailbox, a multishot receive on every peer
+   socket that picks its buffers from a ring registered with the kernel,
+   and chains of linked sends. A single thread reaps completions; any
+   thread may submit.
+
+   The ring is driven with the raw system calls, like userfaultfd, so
+   that no library is needed.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "dsm.h"
+
+#define SQ_ENTRIES 256
+#define CQ_ENTRIES 4096
+#define NBUFS 64		/* Receive buffers, a power of two */
+#define BUF_SIZE 65536		/* Size of each receive buffer */
+#define BUF_GROUP 0
+
+enum op_kind {
+	OP_POLL,
+	OP_RECV,
+	OP_SEND,
+};
+
+/* What a submission was for; its address is the user_data.
+ */
+struct op {
+	int kind;
+	int fd;
+	union {
+		reactor_fn poll;
+		uring_recv_fn recv;
+		uring_done_fn done;
+	} fn;
+	void *arg;
+	size_t len;		/* OP_SEND: bytes in the chain */
+	size_t sent;
+	struct op *next;	/* On the list of ops waiting to be armed */
+};
+
+static int ring_fd = -1;
+static pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries;
+static unsigned sq_queued;	/* Filled in but not yet submitted */
+
+static struct io_uring_buf_ring *buf_ring;
+static char *bufs;
+
+/* Polls and receives are armed by the completion thread, so that the
+ * kernel runs their work in a thread that is waiting for it rather than
+ * in whichever thread asked for them.
+ */
+static int kick_fd;
+static struct op *arm_head;
+static pthread_mutex_t arm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct op *
+new_op(int kind, int fd, void *arg)
+{
+	struct op *op = calloc(1, sizeof(*op));
+
+	if (op == NULL)
+		errExit("calloc");
+	op->kind = kind;
+	op->fd = fd;
+	op->arg = arg;
+	return op;
+}
+
+static int
+uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/* Hand the queued submissions to the kernel. Called with sq_lock held.
+ */
+static void
+submit(void)
+{
+	int n;
+
+	while (sq_queued > 0) {
+		n = uring_enter(sq_queued, 0, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			errExit("io_uring_enter");
+		sq_queued -= n;
+	}
+}
+
+/* Take a free submission entry. Called with sq_lock held.
+ */
+static struct io_uring_sqe *
+get_sqe(void)
+{
+	unsigned tail = *sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+		submit();
+
+	sqe = &sqes[tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[tail & *sq_mask] = tail & *sq_mask;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	sq_queued++;
+	return sqe;
+}
+
+static void
+arm_poll(struct op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(&sq_lock);
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = op->fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (unsigned long) op;
+	submit();
+	pthread_mutex_unlock(&sq_lock);
+}
+
+static void
+arm_recv(struct op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(&sq_lock);
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = op->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUF_GROUP;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = (unsigned long) op;
+	submit();
+	pthread_mutex_unlock(&sq_lock);
+}
+
+/* Give receive buffer bid back to the kernel. Only the completion thread
+ * does this.
+ */
+static void
+recycle(unsigned bid)
+{
+	unsigned short tail = buf_ring->tail;
+	struct io_uring_buf *b = &buf_ring->bufs[tail & (NBUFS - 1)];
+
+	b->addr = (unsigned long) (bufs + (size_t) bid * BUF_SIZE);
+	b->len = BUF_SIZE;
+	b->bid = bid;
+	__atomic_store_n(&buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void
+complete(struct io_uring_cqe *cqe)
+{
+	struct op *op = (struct op *) (unsigned long) cqe->user_data;
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	unsigned bid;
+
+	switch (op->kind) {
+	case OP_POLL:
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+			errExit("io_uring poll");
+		}
+		op->fn.poll(op->fd, op->arg);
+		if (!more)
+			arm_poll(op);
+		break;
+
+	case OP_RECV:
+		/* The multishot receive stops when it runs out of buffers;
+		 * it is simply started again.
+		 */
+		if (cqe->res == -ENOBUFS) {
+			if (!more)
+				arm_recv(op);
+			break;
+		}
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+			errExit("io_uring recv");
+		}
+		if (cqe->res == 0) {
+			op->fn.recv(op->arg, NULL, 0);
+			break;
+		}
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		op->fn.recv(op->arg, bufs + (size_t) bid * BUF_SIZE, cqe->res);
+		recycle(bid);
+		if (!more)
+			arm_recv(op);
+		break;
+
+	case OP_SEND:
+		/* Only failures and the end of the chain post completions */
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+			errExit("io_uring send");
+		}
+		op->sent += cqe->res;
+		if (op->sent != op->len) {
+			fprintf(stderr, "Short send on a linked chain\n");
+			exit(EXIT_FAILURE);
+		}
+		op->fn.done(op->arg);
+		free(op);
+		break;
+	}
+}
+
+static void
+kick_ready(int fd, void *arg)
+{
+	struct op *op, *next;
+	eventfd_t v;
+
+	if (eventfd_read(fd, &v) == -1 && errno != EAGAIN)
+		errExit("eventfd_read");
+
+	pthread_mutex_lock(&arm_lock);
+	op = arm_head;
+	arm_head = NULL;
+	pthread_mutex_unlock(&arm_lock);
+
+	for (; op; op = next) {
+		next = op->next;
+		if (op->kind == OP_POLL)
+			arm_poll(op);
+		else
+			arm_recv(op);
+	}
+}
+
+static void *
+uring_thread(void *arg)
+{
+	struct op *kick = arg;
+	unsigned head, tail;
+
+	arm_poll(kick);
+
+	for (;;) {
+		if (uring_enter(0, 1, IORING_ENTER_GETEVENTS) == -1 &&
+		    errno != EINTR)
+			errExit("io_uring_enter");
+
+		head = *cq_head;
+		tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			complete(&cqes[head & *cq_mask]);
+			__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+void
+uring_init(void)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	size_t sq_len, cq_len;
+	char *sq, *cq;
+	struct op *kick;
+	pthread_t thr;
+	int s;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = CQ_ENTRIES;
+	ring_fd = syscall(__NR_io_uring_setup, SQ_ENTRIES, &p);
+	if (ring_fd == -1)
+		errExit("io_uring_setup");
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		fprintf(stderr, "io_uring is too old\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Submission and completion rings share one mapping */
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > sq_len)
+		sq_len = cq_len;
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		errExit("mmap");
+	cq = sq;
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		errExit("mmap");
+
+	sq_head = (unsigned *) (sq + p.sq_off.head);
+	sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *) (sq + p.sq_off.array);
+	sq_entries = p.sq_entries;
+	cq_head = (unsigned *) (cq + p.cq_off.head);
+	cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/* Receive buffers the kernel picks from for multishot receives */
+	buf_ring = mmap(NULL, NBUFS * sizeof(struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	bufs = mmap(NULL, (size_t) NBUFS * BUF_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf_ring == MAP_FAILED || bufs == MAP_FAILED)
+		errExit("mmap");
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) buf_ring;
+	reg.ring_entries = NBUFS;
+	reg.bgid = BUF_GROUP;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING,
+		    &reg, 1) == -1)
+		errExit("io_uring_register");
+	buf_ring->tail = 0;
+	for (int i = 0; i < NBUFS; i++)
+		recycle(i);
+
+	kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (kick_fd == -1)
+		errExit("eventfd");
+	kick = new_op(OP_POLL, kick_fd, NULL);
+	kick->fn.poll = kick_ready;
+	s = pthread_create(&thr, NULL, uring_thread, kick);
+	if (s != 0) {
+		errno = s;
+		errExit("pthread_create");
+	}
+}
+
+/* Have the completion thread arm op.
+ */
+static void
+defer_arm(struct op *op)
+{
+	pthread_mutex_lock(&arm_lock);
+	op->next = arm_head;
+	arm_head = op;
+	pthread_mutex_unlock(&arm_lock);
+	if (eventfd_write(kick_fd, 1) == -1)
+		errExit("eventfd_write");
+}
+
+void
+uring_poll(int fd, reactor_fn fn, void *arg)
+{
+	struct op *op = new_op(OP_POLL, fd, arg);
+
+	op->fn.poll = fn;
+	defer_arm(op);
+}
+
+void
+uring_recv(int fd, uring_recv_fn fn, void *arg)
+{
+	struct op *op = new_op(OP_RECV, fd, arg);
+
+	op->fn.recv = fn;
+	defer_arm(op);
+}
+
+void
+uring_send(int fd, struct iovec *iov, int cnt, uring_done_fn done, void *arg)
+{
+	struct op *op = new_op(OP_SEND, fd, arg);
+	struct io_uring_sqe *sqe;
+
+	op->fn.done = done;
+	for (int i = 0; i < cnt; i++)
+		op->len += iov[i].iov_len;
+
+	/* Linked sends go out in order, and each one waits for all of its
+	 * bytes. Only the last one reports, unless something fails; it
+	 * then carries the length of the whole chain.
+	 */
+	pthread_mutex_lock(&sq_lock);
+	if (sq_entries - (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE))
+	    < (unsigned) cnt)
+		submit();
+	for (int i = 0; i < cnt; i++) {
+		sqe = get_sqe();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long) iov[i].iov_base;
+		sqe->len = iov[i].iov_len;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		sqe->user_data = (unsigned long) op;
+		if (i < cnt - 1)
+			sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	}
+	op->sent = op->len - iov[cnt - 1].iov_len;
+	submit();
+	pthread_mutex_unlock(&sq_lock);
+}
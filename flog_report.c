@@ -0,0 +1,352 @@
+/* flog_report.c
+
+   Decode the fault logs that nodes wrote with -F or the faultlog field
+   of struct dsm_config, and summarize them: how many faults of each kind
+   the nodes took and how long serving them took, and the pages and
+   threads that faulted most. With -d every event is printed instead, in
+   the order the nodes' clocks put them.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dsm.h"
+
+#define DEFAULT_TOP 10
+
+enum kind {
+	KIND_READ,		/* Read miss */
+	KIND_WRITE,		/* Write miss */
+	KIND_UPGRADE,		/* Write to a read-only copy */
+	KINDS,
+};
+
+static const char *kind_names[KINDS] = { "read", "write", "upgrade" };
+
+/* An event of some node's handler, with its time of day.
+ */
+struct rec {
+	int node;
+	int handler;
+	uint64_t when;		/* Nanoseconds since the epoch */
+	struct flog_event e;
+};
+
+struct page {
+	unsigned long pgno;
+	unsigned long count[KINDS];
+	unsigned long faults;
+	unsigned long latency;	/* Sum, in nanoseconds */
+	unsigned long nodes;	/* Bit per node that faulted on it */
+};
+
+struct thread {
+	int node;
+	uint32_t tid;
+	unsigned long faults;
+	unsigned long latency;
+};
+
+static struct rec *recs;
+static unsigned long num_recs, max_recs;
+static unsigned long lost;	/* Overwritten before the log was read */
+static struct flog_header region;	/* Of the first log */
+
+static enum kind
+kind_of(const struct flog_event *e)
+{
+	if (!(e->flags & FLOG_WRITE))
+		return KIND_READ;
+	return e->flags & FLOG_WP ? KIND_UPGRADE : KIND_WRITE;
+}
+
+static void
+add_rec(int node, int handler, const struct flog_header *h,
+	const struct flog_event *e)
+{
+	if (num_recs == max_recs) {
+		max_recs = max_recs ? 2 * max_recs : FLOG_EVENTS;
+		recs = realloc(recs, max_recs * sizeof(*recs));
+		if (recs == NULL)
+			errExit("realloc");
+	}
+	recs[num_recs].node = node;
+	recs[num_recs].handler = handler;
+	recs[num_recs].when = h->real_ns + (e->t - h->mono_ns);
+	recs[num_recs].e = *e;
+	num_recs++;
+}
+
+static void
+load(const char *path)
+{
+	const struct flog_header *h;
+	const struct flog_ring *r;
+	struct stat st;
+	uint64_t head, first;
+	char *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		errExit(path);
+	if (fstat(fd, &st) == -1)
+		errExit("fstat");
+	if ((size_t) st.st_size < sizeof(*h)) {
+		fprintf(stderr, "%s is not a fault log\n", path);
+		exit(EXIT_FAILURE);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		errExit("mmap");
+	close(fd);
+
+	h = (const struct flog_header *) p;
+	if (memcmp(h->magic, FLOG_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != FLOG_VERSION || h->node >= MAX_NODES ||
+	    h->events == 0 || (h->events & (h->events - 1)) != 0 ||
+	    h->granule == 0 ||
+	    (size_t) st.st_size < sizeof(*h) + h->rings * FLOG_RING_SIZE(h->events)) {
+		fprintf(stderr, "%s is not a fault log\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (region.granule == 0) {
+		region = *h;
+	} else if (h->base != region.base || h->len != region.len ||
+		   h->granule != region.granule) {
+		fprintf(stderr, "%s is of a different region\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* A full ring holds its last events, from the oldest at head on */
+	for (uint32_t i = 0; i < h->rings; i++) {
+		r = (const struct flog_ring *) (p + sizeof(*h) +
+						i * FLOG_RING_SIZE(h->events));
+		head = r->head;
+		first = head > h->events ? head - h->events : 0;
+		lost += first;
+		for (uint64_t k = first; k < head; k++)
+			add_rec(h->node, i, h, &r->ev[k & (h->events - 1)]);
+	}
+	munmap(p, st.st_size);
+}
+
+static int
+cmp_when(const void *a, const void *b)
+{
+	const struct rec *x = a, *y = b;
+
+	return (x->when > y->when) - (x->when < y->when);
+}
+
+static int
+cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a;
+	unsigned long y = *(const unsigned long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int
+cmp_thread(const void *a, const void *b)
+{
+	const struct rec *x = a, *y = b;
+
+	if (x->node != y->node)
+		return x->node - y->node;
+	return (x->e.tid > y->e.tid) - (x->e.tid < y->e.tid);
+}
+
+static int
+more_page_faults(const void *a, const void *b)
+{
+	const struct page *x = a, *y = b;
+
+	if (x->faults != y->faults)
+		return x->faults < y->faults ? 1 : -1;
+	return (x->pgno > y->pgno) - (x->pgno < y->pgno);
+}
+
+static int
+more_thread_faults(const void *a, const void *b)
+{
+	const struct thread *x = a, *y = b;
+
+	if (x->faults != y->faults)
+		return x->faults < y->faults ? 1 : -1;
+	if (x->node != y->node)
+		return x->node - y->node;
+	return (x->tid > y->tid) - (x->tid < y->tid);
+}
+
+static unsigned long
+pgno_of(const struct flog_event *e)
+{
+	return (e->addr - region.base) / region.granule;
+}
+
+static void
+dump(void)
+{
+	uint64_t start = num_recs ? recs[0].when : 0;
+
+	printf("%12s %4s %3s %8s %-8s %10s %8s %10s\n", "time_us", "node",
+	       "hnd", "tid", "kind", "page", "offset", "latency_us");
+	for (unsigned long i = 0; i < num_recs; i++)
+		printf("%12.1f %4d %3d %8u %-8s %10lu %8lu %10.1f\n",
+		       (recs[i].when - start) / 1e3, recs[i].node,
+		       recs[i].handler, recs[i].e.tid,
+		       kind_names[kind_of(&recs[i].e)], pgno_of(&recs[i].e),
+		       (unsigned long) ((recs[i].e.addr - region.base) %
+					region.granule),
+		       recs[i].e.latency / 1e3);
+}
+
+/* Print the count and latency percentiles of n sorted values.
+ */
+static void
+latency_line(const char *name, unsigned long *v, unsigned long n)
+{
+	unsigned long sum = 0;
+
+	if (n == 0) {
+		printf("%-8s %10lu\n", name, n);
+		return;
+	}
+	for (unsigned long i = 0; i < n; i++)
+		sum += v[i];
+	printf("%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+	       n, sum / 1e3 / n, v[n / 2] / 1e3, v[n * 9 / 10] / 1e3,
+	       v[n * 99 / 100] / 1e3, v[n * 999 / 1000] / 1e3, v[n - 1] / 1e3);
+}
+
+static void
+summary(unsigned long top, int nlogs)
+{
+	unsigned long *lat[KINDS + 1], nlat[KINDS + 1] = { 0 };
+	unsigned long npages = region.len / region.granule, nthreads = 0;
+	struct page *pages;
+	struct thread *threads;
+	double span;
+	enum kind k;
+
+	span = num_recs ? (recs[num_recs - 1].when - recs[0].when) / 1e9 : 0;
+	printf("%d logs, %lu faults over %.3f s (%.0f per second), %lu "
+	       "overwritten\n\n", nlogs, num_recs, span,
+	       span > 0 ? num_recs / span : 0.0, lost);
+
+	for (int i = 0; i <= KINDS; i++) {
+		lat[i] = malloc((num_recs ? num_recs : 1) * sizeof(**lat));
+		if (lat[i] == NULL)
+			errExit("malloc");
+	}
+	pages = calloc(npages, sizeof(*pages));
+	threads = calloc(num_recs ? num_recs : 1, sizeof(*threads));
+	if (pages == NULL || threads == NULL)
+		errExit("calloc");
+	for (unsigned long i = 0; i < npages; i++)
+		pages[i].pgno = i;
+
+	for (unsigned long i = 0; i < num_recs; i++) {
+		struct flog_event *e = &recs[i].e;
+		unsigned long pgno = pgno_of(e);
+
+		k = kind_of(e);
+		lat[k][nlat[k]++] = e->latency;
+		lat[KINDS][nlat[KINDS]++] = e->latency;
+		if (e->addr < region.base || pgno >= npages)
+			continue;
+		pages[pgno].count[k]++;
+		pages[pgno].faults++;
+		pages[pgno].latency += e->latency;
+		pages[pgno].nodes |= 1UL << recs[i].node;
+	}
+
+	printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "kind", "faults",
+	       "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+	for (int i = 0; i <= KINDS; i++) {
+		qsort(lat[i], nlat[i], sizeof(**lat), cmp_ulong);
+		latency_line(i < KINDS ? kind_names[i] : "all", lat[i],
+			     nlat[i]);
+		free(lat[i]);
+	}
+
+	qsort(pages, npages, sizeof(*pages), more_page_faults);
+	printf("\n%10s %10s %10s %10s %10s %10s %6s\n", "page", "faults",
+	       "reads", "writes", "upgrades", "mean_us", "nodes");
+	for (unsigned long i = 0; i < npages && i < top && pages[i].faults; i++)
+		printf("%10lu %10lu %10lu %10lu %10lu %10.1f %6d\n",
+		       pages[i].pgno, pages[i].faults, pages[i].count[KIND_READ],
+		       pages[i].count[KIND_WRITE],
+		       pages[i].count[KIND_UPGRADE],
+		       pages[i].latency / 1e3 / pages[i].faults,
+		       __builtin_popcountl(pages[i].nodes));
+
+	/* Count faults by thread, then put the busiest first */
+	qsort(recs, num_recs, sizeof(*recs), cmp_thread);
+	for (unsigned long i = 0; i < num_recs; i++) {
+		if (i == 0 || cmp_thread(&recs[i], &recs[i - 1]) != 0) {
+			threads[nthreads].node = recs[i].node;
+			threads[nthreads].tid = recs[i].e.tid;
+			nthreads++;
+		}
+		threads[nthreads - 1].faults++;
+		threads[nthreads - 1].latency += recs[i].e.latency;
+	}
+	qsort(threads, nthreads, sizeof(*threads), more_thread_faults);
+	printf("\n%6s %10s %10s %10s\n", "node", "tid", "faults", "mean_us");
+	for (unsigned long i = 0; i < nthreads && i < top; i++)
+		printf("%6d %10u %10lu %10.1f\n", threads[i].node,
+		       threads[i].tid, threads[i].faults,
+		       threads[i].latency / 1e3 / threads[i].faults);
+	free(threads);
+	free(pages);
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-d] [-n top] fault-log...\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long top = DEFAULT_TOP;
+	int c, events = 0;
+
+	while ((c = getopt(argc, argv, "dn:")) != -1) {
+		switch (c) {
+		case 'd':
+			events = 1;
+			break;
+		case 'n':
+			top = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+	for (int i = optind; i < argc; i++)
+		load(argv[i]);
+
+	qsort(recs, num_recs, sizeof(*recs), cmp_when);
+	if (events)
+		dump();
+	else
+		summary(top, argc - optind);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,263 @@
+/* prof_report.c
+
+   Merge the page profiles the nodes of a cluster wrote with prof_write()
+   and report the pages that cost the most: the ones faulted on,
+   invalidated and handed between nodes most often. A page is flagged as
+   falsely shared when at least two nodes fault on it and none of them
+   writes a slice another one reads or writes; such a page only bounces
+   because of where its data sits.
+
+   Licensed under the GNU General Public License version 2 or later.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsm.h"
+
+#define DEFAULT_TOP 20
+
+/* One line of a profile.
+ */
+struct entry {
+	unsigned long faults;
+	unsigned long write_faults;
+	unsigned long invals;
+	unsigned long transfers;
+	unsigned long bytes;
+	uint64_t read_slices;
+	uint64_t write_slices;
+};
+
+/* A page with the counters of all nodes added up.
+ */
+struct page {
+	unsigned long pgno;
+	unsigned long events;	/* Faults, invalidations and transfers */
+	struct entry sum;
+	int nodes;		/* Nodes that faulted on it */
+	int false_sharing;
+};
+
+static struct entry *node_entries[MAX_NODES];	/* By page, NULL if absent */
+static int max_node = -1;
+static unsigned long num_pages;
+static unsigned long granule;
+
+static void
+load(const char *path)
+{
+	unsigned long pages, gran, pgno;
+	struct entry e;
+	FILE *f;
+	int node;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		errExit(path);
+	if (fscanf(f, "dsm-profile node %d pages %lu granule %lu", &node,
+		   &pages, &gran) != 3 || node < 0 || node >= MAX_NODES ||
+	    pages == 0 || gran < PROF_SLICES) {
+		fprintf(stderr, "%s is not a page profile\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (num_pages == 0) {
+		num_pages = pages;
+		granule = gran;
+	} else if (pages != num_pages || gran != granule) {
+		fprintf(stderr, "%s is of a different region\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (node_entries[node] != NULL) {
+		fprintf(stderr, "%s: second profile of node %d\n", path, node);
+		exit(EXIT_FAILURE);
+	}
+	node_entries[node] = calloc(num_pages, sizeof(struct entry));
+	if (node_entries[node] == NULL)
+		errExit("calloc");
+	if (node > max_node)
+		max_node = node;
+
+	while (fscanf(f, "%lu %lu %lu %lu %lu %lu %lx %lx", &pgno, &e.faults,
+		      &e.write_faults, &e.invals, &e.transfers, &e.bytes,
+		      &e.read_slices, &e.write_slices) == 8) {
+		if (pgno >= num_pages) {
+			fprintf(stderr, "%s: no page %lu\n", path, pgno);
+			exit(EXIT_FAILURE);
+		}
+		node_entries[node][pgno] = e;
+	}
+	if (!feof(f)) {
+		fprintf(stderr, "%s: bad line\n", path);
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+}
+
+/* Several nodes fault on the page and no node writes what another one
+ * touches.
+ */
+static int
+falsely_shared(unsigned long pgno)
+{
+	struct entry *a, *b;
+	int writers = 0, nodes = 0;
+
+	for (int i = 0; i <= max_node; i++) {
+		if (node_entries[i] == NULL)
+			continue;
+		a = &node_entries[i][pgno];
+		if (a->faults == 0)
+			continue;
+		nodes++;
+		writers += a->write_slices != 0;
+		for (int j = 0; j <= max_node; j++) {
+			if (j == i || node_entries[j] == NULL)
+				continue;
+			b = &node_entries[j][pgno];
+			if (a->write_slices & (b->read_slices | b->write_slices))
+				return 0;
+		}
+	}
+	return nodes >= 2 && writers >= 1;
+}
+
+static void
+merge(struct page *p, unsigned long pgno)
+{
+	struct entry *e;
+
+	memset(p, 0, sizeof(*p));
+	p->pgno = pgno;
+	for (int i = 0; i <= max_node; i++) {
+		if (node_entries[i] == NULL)
+			continue;
+		e = &node_entries[i][pgno];
+		p->sum.faults += e->faults;
+		p->sum.write_faults += e->write_faults;
+		p->sum.invals += e->invals;
+		p->sum.transfers += e->transfers;
+		p->sum.bytes += e->bytes;
+		p->nodes += e->faults > 0;
+	}
+	p->events = p->sum.faults + p->sum.invals + p->sum.transfers;
+	p->false_sharing = falsely_shared(pgno);
+}
+
+static int
+hotter(const void *a, const void *b)
+{
+	const struct page *x = a, *y = b;
+
+	if (x->events != y->events)
+		return x->events < y->events ? 1 : -1;
+	return x->pgno < y->pgno ? -1 : x->pgno > y->pgno;
+}
+
+/* Print the byte ranges of the page that the slices in mask cover.
+ */
+static void
+print_slices(uint64_t mask)
+{
+	unsigned long size = granule / PROF_SLICES;
+	const char *sep = "";
+	int s, e;
+
+	for (s = 0; s < PROF_SLICES; s = e) {
+		if (!(mask & (1UL << s))) {
+			e = s + 1;
+			continue;
+		}
+		for (e = s; e < PROF_SLICES && (mask & (1UL << e)); e++)
+			;
+		printf("%s%lu-%lu", sep, s * size, e * size - 1);
+		sep = ",";
+	}
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n pages] profile...\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long top = DEFAULT_TOP, nhot = 0, nfalse = 0;
+	struct page *hot;
+	struct entry *e;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			top = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+	for (int i = optind; i < argc; i++)
+		load(argv[i]);
+
+	hot = calloc(num_pages, sizeof(*hot));
+	if (hot == NULL)
+		errExit("calloc");
+	for (unsigned long i = 0; i < num_pages; i++) {
+		merge(&hot[nhot], i);
+		if (hot[nhot].events > 0 || hot[nhot].sum.bytes > 0)
+			nhot++;
+	}
+	qsort(hot, nhot, sizeof(*hot), hotter);
+
+	printf("%d profiles, %lu of %lu pages of %lu bytes active\n\n",
+	       argc - optind, nhot, num_pages, granule);
+	printf("%10s %10s %10s %10s %10s %10s %6s\n", "page", "faults",
+	       "writes", "invals", "transfers", "KB", "nodes");
+	for (unsigned long i = 0; i < nhot && i < top; i++)
+		printf("%10lu %10lu %10lu %10lu %10lu %10lu %6d%s\n",
+		       hot[i].pgno, hot[i].sum.faults, hot[i].sum.write_faults,
+		       hot[i].sum.invals, hot[i].sum.transfers,
+		       hot[i].sum.bytes >> 10, hot[i].nodes,
+		       hot[i].false_sharing ? "  false sharing" : "");
+
+	/* Show where each node works in the falsely shared pages, hottest
+	 * first, so the data can be split along those lines.
+	 */
+	for (unsigned long i = 0; i < nhot; i++) {
+		if (!hot[i].false_sharing)
+			continue;
+		if (nfalse++ == 0)
+			printf("\nFalsely shared pages, bytes each node faulted "
+			       "on:\n");
+		printf("%10lu", hot[i].pgno);
+		for (int n = 0; n <= max_node; n++) {
+			if (node_entries[n] == NULL)
+				continue;
+			e = &node_entries[n][hot[i].pgno];
+			if (e->faults == 0)
+				continue;
+			printf("  node %d", n);
+			if (e->write_slices) {
+				printf(" writes ");
+				print_slices(e->write_slices);
+			}
+			if (e->read_slices & ~e->write_slices) {
+				printf(" reads ");
+				print_slices(e->read_slices & ~e->write_slices);
+			}
+		}
+		printf("\n");
+	}
+	if (nfalse == 0)
+		printf("\nNo falsely shared pages\n");
+	exit(EXIT_SUCCESS);
+}
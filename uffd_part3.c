@@ -22,370 +22,400 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "dsm.h"
+
 #define PORT 8081
 #define BUFF_SIZE 4096
 
-
-#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE);	\
-	} while (0)
-
 static int page_size;
+static struct dsm_region rgn;	/* The shared region */
+static unsigned long granule;	/* Coherence unit, rgn.granule */
+static int prefetch_window = DEFAULT_PREFETCH;
+static int transport = DSM_SOCKETS;	/* How nodes talk to each other */
+static int one_lane;		/* See msi_set_lanes() */
+static char *profile;		/* Where the p command writes the profile */
+static char *stats;		/* Where fault latencies go every second */
+static char *record;		/* Where the access trace goes at the end */
+static char *faultlog;		/* Where the fault log is mapped */
+static struct trace replay;	/* Trace run instead of the command loop */
+static int timed;		/* ... keeping its think times */
+
+static void
+write_profile(void)
+{
+	FILE *f;
 
-static void *
-fault_handler_thread(void *arg)
+	f = fopen(profile, "w");
+	if (f == NULL) {
+		perror(profile);
+		return;
+	}
+	prof_write(f);
+	fclose(f);
+	printf("Profile written to %s\n", profile);
+}
+
+static void
+write_record(void)
 {
-	static struct uffd_msg msg;   /* Data read from userfaultfd */
-	/*static int fault_cnt = 0;*/     /* Number of faults so far handled */
-	long uffd;                    /* userfaultfd file descriptor */
-	static char *page = NULL;
-	struct uffdio_copy uffdio_copy;
-	ssize_t nread;
-
-	uffd = (long) arg;
-
-	/* [H1: point 1]
-	 * Creates a new mapping in the virtual address space of the calling process. Since address is NULL
-	 * kernel chooses page-aligned address to create the mapping.
-	 */
-	if (page == NULL) {
-		page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
-			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if (page == MAP_FAILED)
-			errExit("mmap");
+	FILE *f;
+
+	f = fopen(record, "w");
+	if (f == NULL) {
+		perror(record);
+		return;
 	}
+	trace_write(f);
+	fclose(f);
+	printf("Access trace written to %s\n", record);
+}
 
-	/* [H2: point 1]
-	 * Loop for handling events from the userfaultfd file descriptor.
-	 */
-	for (;;) {
-
-		/* See what poll() tells us about the userfaultfd */
-
-		struct pollfd pollfd;
-		int nready;
-
-		/* [H3: point 1]
-		 * Get the data from the poll() function along with its status.
-		 */
-		pollfd.fd = uffd;
-		pollfd.events = POLLIN;
-		nready = poll(&pollfd, 1, -1);
-		if (nready == -1)
-			errExit("poll");
-
-		/*printf("\nfault_handler_thread():\n");
-		printf("    poll() returns: nready = %d; "
-                       "POLLIN = %d; POLLERR = %d\n", nready,
-                       (pollfd.revents & POLLIN) != 0,
-                       (pollfd.revents & POLLERR) != 0);*/
-
-		/* [H4: point 1]
-		 * Read the user specified argument and exit when reading is done or 
-		 * conditions for end of file argument are met..
-		 */
-		nread = read(uffd, &msg, sizeof(msg));
-		if (nread == 0) {
-			printf("EOF on userfaultfd!\n");
-			exit(EXIT_FAILURE);
-		}
+/* Replay this node's part of the trace.
+ */
+static void
+replay_trace(char *addr, int self)
+{
+	unsigned long t, n;
 
-		if (nread == -1)
-			errExit("read");
+	t = lat_now();
+	n = trace_replay(&replay, addr, self, timed);
+	t = lat_now() - t;
+	printf("Replayed %lu records in %.3f s (%.0f per second)\n", n,
+	       t / 1e9, t ? n * 1e9 / t : 0.0);
+}
 
-		/* [H5: point 1]
-		 * Handle conditions when unexpected events occur on userfaultfd.
-		 */
-		if (msg.event != UFFD_EVENT_PAGEFAULT) {
-			fprintf(stderr, "Unexpected event on userfaultfd\n");
-			exit(EXIT_FAILURE);
+/* Repeatedly ask which page to read or write and do it.
+ */
+static void
+command_loop(char *addr, unsigned long len)
+{
+	int pages = len / page_size;
+	char command;
+	int pg_num;
+	unsigned int lock;
+	char *buffer = NULL;
+	size_t size = 0;
+	char dest[page_size];
+
+	while(1){
+		printf("Which command should I run ? (r:read, w:write, "
+		       "a:acquire, e:release, l:lock, u:unlock, b:barrier%s):\n",
+		       profile ? ", p:profile" : "");
+		if (scanf("%c", &command) != 1)
+			return;
+		while((getchar()) != '\n');
+		if (command == 'a' || command == 'e' || command == 'b') {
+			if (command == 'a')
+				dsm_acquire();
+			else if (command == 'e')
+				dsm_release();
+			else
+				dsm_barrier();
+			printf("Done\n");
+			continue;
+		}
+		if (command == 'p' && profile) {
+			write_profile();
+			continue;
+		}
+		if (command == 'l' || command == 'u') {
+			printf("Which lock? (0-%d)\n", DSM_LOCKS - 1);
+			if (scanf("%u", &lock) != 1)
+				return;
+			while((getchar()) != '\n');
+			if (lock >= DSM_LOCKS) {
+				printf("No such lock\n");
+				continue;
+			}
+			if (command == 'l')
+				dsm_lock(lock);
+			else
+				dsm_unlock(lock);
+			printf("Done\n");
+			continue;
+		}
+		printf("For which page? (0-%d, or -1 for all)\n", pages - 1);
+		if (scanf("%d", &pg_num) != 1)
+			return;
+		while((getchar()) != '\n');
+		if (pg_num < -1 || pg_num >= pages) {
+			printf("No such page\n");
+			continue;
+		}
+		if (command == 'r'){
+			for (int i = 0; i < pages; i++){
+				if (pg_num != -1 && i != pg_num)
+					continue;
+				memcpy(dest, addr + (unsigned long) i * page_size, page_size);
+				dest[page_size - 1] = '\0';
+				printf("[*] Page %d:\n%s\n", i, dest);
+			}
 		}
 
-		/* [H6: point 1]
-		 * Print the address and flags associated with the pagefault event.
-		 */
-		printf("[x] PAGEFAULT\n");
-		//printf("flags = %llx; ", msg.arg.pagefault.flags);
-		//printf("address = %llx\n", msg.arg.pagefault.address);
-
-		/* [H7: point 1]
-		 * Copy the page into the faulting region and varying the contents copied in, so that each page fault is handled separately. 
-		 
-		memset(page, 'A' + fault_cnt % 20, page_size);
-		fault_cnt++;*/
-
-		/* [H8: point 1]
-		 * Handle page faults in unit of pages.
-		 */
-		uffdio_copy.src = (unsigned long) page;
-		uffdio_copy.dst = (unsigned long) msg.arg.pagefault.address &
-			~(page_size - 1);
-		uffdio_copy.len = page_size;
-		uffdio_copy.mode = 0;
-		uffdio_copy.copy = 0;
-
-		/* [H9: point 1]
-		 * Round faulting address down to page boundary.
-		 */
-		if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1)
-			errExit("ioctl-UFFDIO_COPY");
-
-		/* [H10: point 1]
-		 * Printing the copy returned from the page fault unit along with its length.
-		 
-		printf("(uffdio_copy.copy returned %lld)\n",uffdio_copy.copy);*/
+		else{
+			printf("Enter string to be written\n");
+			int bytes_read = getline(&buffer, &size, stdin);
+			if (bytes_read == -1)
+				return;
+			printf("Number of bytes read %d\n", bytes_read);
+			if (bytes_read >= page_size)
+				bytes_read = page_size - 1;
+			for (int i = 0; i < pages; i++){
+				if (pg_num != -1 && i != pg_num)
+					continue;
+				memcpy(addr + (unsigned long) i * page_size, buffer,
+				       bytes_read);
+				addr[(unsigned long) i * page_size + bytes_read] = '\0';
+				printf("[*] Page %d written with %s: \n", i, buffer);
+			}
+		}
 	}
 }
 
-struct to_send{
-	char *a;
-	int b;
-};
-
-struct to_receive{
-	char *a;
-	int b;
-};
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c] [-d] [-l] [-H] [-M] [-N] [-S] [-g granule] "
+		"[-b anon|hugetlb|memfd]\n"
+		"\t[-p prefetch-window] [-t sockets|uring]\n"
+		"\t[-m members] [-P profile] [-s stats-file|unix:path] [-v]\n"
+		"\t[-F fault-log] [-R record-file] [-T trace [-r]]\n"
+		"\tserver|client|node-id [num-handlers]\n", prog);
+	exit(EXIT_FAILURE);
+}
 
 int
 main(int argc, char *argv[])
 {
-	long uffd;          /* userfaultfd file descriptor */
 	char *addr;         /* Start of region handled by userfaultfd */
 	unsigned long len;  /* Length of region handled by userfaultfd */
-	pthread_t thr;      /* ID of thread that handles page faults */
-	struct uffdio_api uffdio_api;
-	struct uffdio_register uffdio_register;
-	int s;
-        int server_fd, new_socket;
-	struct sockaddr_in address;
-	int opt = 1;
-	int addrlen = sizeof(address);
-	int sock = 0;
-	struct sockaddr_in serv_addr;
-	char command;
-        int pg_num;
+	int nhandlers;      /* Number of threads that handle page faults */
+	struct dsm_node nodes[MAX_NODES];	/* Membership list */
+	int peer[MAX_NODES];	/* Connection to each other node */
+	int nnodes, self;
+	char *members = NULL;
 	char *server = "server";
 	char *client = "client";
-
-	if (argc == 2 && strcmp(argv[1],server) == 0){
-		char num_page[1];
-		printf("Enter number of pages \n");
-		scanf("%s", num_page);
-		printf("Number of pages are: %s\n", num_page);
-
-		if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-			perror("\n Socket failed \n");
-			exit(EXIT_FAILURE);
+	char *role, *end;
+	char *trace = NULL;
+	int c;
+
+	page_size = sysconf(_SC_PAGE_SIZE);
+	rgn.granule = page_size;
+	rgn.backing = DSM_ANON;
+	while ((c = getopt(argc, argv, "cdlHMNSrvg:b:p:m:t:s:F:P:R:T:")) != -1) {
+		switch (c) {
+		case 'c':
+			msi_set_compress(1);
+			break;
+		case 'd':
+			msi_set_diff(1);
+			break;
+		case 'l':
+			msi_set_lrc(1);
+			break;
+		case 'H':
+			msi_set_home_moves(0);
+			break;
+		case 'M':
+			msi_set_migratory(0);
+			break;
+		case 'N':
+			shm_set(0);
+			break;
+		case 'S':
+			one_lane = 1;
+			msi_set_lanes(0);
+			break;
+		case 'g':
+			rgn.granule = region_parse_size(optarg);
+			break;
+		case 'b':
+			rgn.backing = region_backing(optarg);
+			if (rgn.backing == -1)
+				usage(argv[0]);
+			break;
+		case 'p':
+			prefetch_window = strtoul(optarg, NULL, 0);
+			if (prefetch_window > MAX_PREFETCH)
+				usage(argv[0]);
+			break;
+		case 'm':
+			members = optarg;
+			break;
+		case 'P':
+			profile = optarg;
+			break;
+		case 's':
+			stats = optarg;
+			break;
+		case 'v':
+			fault_set_trace(1);
+			break;
+		case 'F':
+			faultlog = optarg;
+			break;
+		case 'R':
+			record = optarg;
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'r':
+			timed = 1;
+			break;
+		case 't':
+			transport = reactor_transport(optarg);
+			if (transport == -1)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
 		}
+	}
 
-		if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, 
-					&opt, sizeof(opt))) {
-			perror("setsockopt");
-			exit(EXIT_FAILURE);
-		}
-
-		address.sin_family = AF_INET;
-		address.sin_addr.s_addr = INADDR_ANY;
-		address.sin_port = htons( PORT );
-
-		if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-			printf("\nBind Failed \n");
-			exit(EXIT_FAILURE);
+	/* [M1: point 1]
+	 * Check the arguments passed to the userfaultfd program.
+	 */
+	if ((argc - optind != 1 && argc - optind != 2) || (timed && !trace))
+		usage(argv[0]);
+	if (trace)
+		trace_load(trace, &replay);
+	role = argv[optind];
+	nhandlers = DEFAULT_HANDLERS;
+	if (argc - optind == 2)
+		nhandlers = strtoul(argv[optind + 1], NULL, 0);
+
+	/* Without a membership list the server and the client make up a
+	 * cluster of two on this machine.
+	 */
+	if (members != NULL) {
+		nnodes = cluster_load(members, nodes);
+		self = strtol(role, &end, 10);
+		if (*role == '\0' || *end != '\0' || self < 0 || self >= nnodes)
+			usage(argv[0]);
+	} else {
+		nnodes = 2;
+		for (int i = 0; i < nnodes; i++) {
+			strcpy(nodes[i].host, "127.0.0.1");
+			snprintf(nodes[i].port, sizeof(nodes[i].port), "%d",
+				 PORT + i);
 		}
+		if (strcmp(role, server) == 0)
+			self = 0;
+		else if (strcmp(role, client) == 0)
+			self = 1;
+		else
+			usage(argv[0]);
+	}
 
-
-		/* [M1: point 1]
-	 * Check the arguments passed to the userfaultfd program
-	 * contains number of pages whose page faults will be handled. 
+	/* Node 0 sizes the region and hands its description to the others.
 	 */
-		if (argc != 2) {
-			fprintf(stderr, "Usage: %s num-pages\n", argv[0]);
-			exit(EXIT_FAILURE);
-		}
+	if (self == 0){
+		char num_page[16];
+		if (trace) {
+			/* The trace says how large the region is */
+			rgn.granule = replay.granule;
+			rgn.len = replay.pages * replay.granule;
+		} else {
+			printf("Enter number of pages \n");
+			scanf("%15s", num_page);
+			printf("Number of pages are: %s\n", num_page);
 
 	/* [M2: point 1]
 	 * Calculate the length of the region to be handled by userfaultfd.
+	 * It is rounded up to whole granules.
 	 */	
-		char *a = (char *)num_page;	
-		page_size = sysconf(_SC_PAGE_SIZE);
-		len = strtoul(a, NULL, 0) * page_size;
-			
-	/* [M3: point 1]
-	 * Create userfaultfd object.
-	 */
-		uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
-		if (uffd == -1)
-			errExit("userfaultfd");
+			char *a = (char *)num_page;	
+			rgn.len = strtoul(a, NULL, 0) * page_size;
+		}
 
-	/* [M4: point 1]
-	 * Enable the userfaultfd object.
-	 */
-		uffdio_api.api = UFFD_API;
-		uffdio_api.features = 0;
-		if (ioctl(uffd, UFFDIO_API, &uffdio_api) == -1)
-			errExit("ioctl-UFFDIO_API");
-
-	/* [M5: point 1]
-	 * Create a private anonymous mapping. The memory will not be allocated by default,
-	 * but will be allocated when we touch it via the userfaultfd. 
+	/* [M3: point 1]
+	 * Create the userfaultfd object, map the region and register it for
+	 * missing and write-protect faults.
 	 */
-		addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
-			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if (addr == MAP_FAILED)
-			errExit("mmap");
+		region_create(&rgn, NULL);
+		addr = rgn.base;
+		len = rgn.len;
+		granule = rgn.granule;
 
 		printf("Address returned by mmap() = %p\n", addr);
+		printf("Granule: %lu bytes, backing: %s\n", granule,
+		       region_backing_name(rgn.backing));
 
-		printf("Press key to send address and length\n");
-		getchar();
-		printf("Sending address\n");
-      
-		if (listen(server_fd, 3) < 0){
-			perror("listen");
-			exit(EXIT_FAILURE);
-		}		
-
-		if ((new_socket = accept(server_fd, (struct sockaddr *)&address, 
-						(socklen_t*)&addrlen)) < 0){
-			perror("accept");
-			exit(EXIT_FAILURE);
+		if (!trace) {
+			printf("Press key to send address and length\n");
+			getchar();
 		}
+		printf("Sending address\n");
 
-		char *add = (char *)addr;	
-		struct to_send buffer = {add, len};
-        	send(new_socket, (char *)&buffer, sizeof(buffer), 0);
-        	printf("Address and length sent to client: %p, %d\n", buffer.a, buffer.b);
-	
-	/* [M6: point 1]
-	 * Register the memory range of the mapping we created for handling the userfaultfd object.
-	 *In mode, we request to track missing pages.
-	 */
-	
-		uffdio_register.range.start = (unsigned long) addr;
-		uffdio_register.range.len = len;
-		uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING;
-		if (ioctl(uffd, UFFDIO_REGISTER, &uffdio_register) == -1)
-			errExit("ioctl-UFFDIO_REGISTER");
+		cluster_connect(self, nnodes, nodes, peer, !one_lane);
 
-	/* [M7: point 1]
-	 * Create a thread that will process userfaultfd events.
-	 */
-		s = pthread_create(&thr, NULL, fault_handler_thread, (void *) uffd);
-		if (s != 0) {
-			errno = s;
-			errExit("pthread_create");
-		}
-		int pages = strtoul(a, NULL, 0);
-		while(1){
-			printf("Which command should I run ? (r:read, w:write):\n");
-			scanf("%c", &command);
-			while((getchar()) != '\n');
-			printf("For which page? (0-%d, or -1 for all)\n", pages - 1);
-		        scanf("%d", &pg_num);
-			while((getchar()) != '\n');
-			if (command == 'r'){
-				if (pg_num == -1){
-					for(int i = 0; i < pages; i++){
-						char dest[len/pages];
-						int l = (i*(len/pages)) + 0x0;
-						memcpy(dest, addr + l, (len/pages));
-						printf("[*] Page %d:\n%s\n", i, dest);
-					}
-				}
-				else {
-					int l = (pg_num*(len/pages)) + 0x0;
-					char dest[4096];
-					memcpy(dest, addr + l, 4096);
-					printf("[*] Page %d:\n%s\n", pg_num, dest);
-				}
-			}
-
-			else{
-				if (pg_num == -1){
-					char *buffer;
-					size_t size = 4096;
-					buffer = (char *)malloc(size);
-					printf("Enter string to be written\n");
-					int bytes_read = getline(&buffer, &size, stdin);
-					printf("Number of bytes read %d:\n", bytes_read);
-					for (int i = 0; i < pages; i++){				
-						int l = (i*(len/pages)) + 0x0;
-						memcpy(addr + l, buffer, size);
-						printf("[*] Page %d written with %s: \n", i, buffer);
-					}
-				}
-
-				else{
-					char *buffer;
-					size_t size = 4096;
-					buffer = (char *)malloc(size);
-					printf("Enter string to be written\n");				
-					int bytes_read = getline(&buffer, &size, stdin);
-					printf("Number of bytes read %d\n", bytes_read);
-					int l = (pg_num*(len/pages)) + 0x0;
-					memcpy(addr + l, buffer, 4096);
-					printf("[*] Page %d written with %s: \n", pg_num, buffer);
-				}
-			}	
-		}		
-		
+		for (int i = 1; i < nnodes; i++)
+			msi_send_region(peer[i], &rgn);
+		printf("Address and length sent to %d nodes: %p, %lu\n",
+		       nnodes - 1, addr, len);
 	}
 
-	if (argc == 2 && strcmp(argv[1],client) == 0){
-		if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0){
-			printf("Socket creation error \n");
-			return -1;
-		}
-
-		memset(&serv_addr, '0', sizeof(serv_addr));
-		serv_addr.sin_family = AF_INET;
-		serv_addr.sin_port = htons(PORT);
-
-		if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0){
-			printf("Invalid address/ Address not supported \n");
-			return -1;
-		}
-
-		while (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0){
-			printf("Connecting to server \n");
-			sleep(2);
-		}
+	else{
+		cluster_connect(self, nnodes, nodes, peer, !one_lane);
 		printf("Connection established\n");
 
-		page_size = sysconf(_SC_PAGE_SIZE);
-		uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
-		if (uffd == -1)
-			errExit("userfaultfd");
-
-		uffdio_api.api = UFFD_API;
-		uffdio_api.features = 0;
-		if (ioctl(uffd, UFFDIO_API, &uffdio_api) == -1)
-			errExit("ioctl-UFFDIO_API");
-
-		struct to_receive data;
-		printf("Print any key to receive data \n");
-		getchar();
+		if (!trace) {
+			printf("Print any key to receive data \n");
+			getchar();
+		}
 
-		read(sock, (char *)&data, 1024);
-		printf("Address received: %p\n", data.a);
-		printf("Length received: %d\n", data.b);
-		unsigned long len_rec = (long)data.b;
+		addr = msi_recv_region(peer[0], &rgn);
+		printf("Address received: %p\n", addr);
+		printf("Length received: %lu\n", rgn.len);
 
-		char *add = mmap((char *)(data.a), len_rec, PROT_READ | PROT_WRITE,
-				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if (add == MAP_FAILED)
-			errExit("mmap");
+		/* The other nodes map the region the way node 0 did */
+		region_create(&rgn, addr);
+		granule = rgn.granule;
 
-		printf("Address shared by mmap() = %p\n", add);
+		printf("Address shared by mmap() = %p\n", rgn.base);
+		printf("Memory Registered\n");
+	}
 
-		uffdio_register.range.start = (unsigned long) add;
-		uffdio_register.range.len = len_rec;
-		uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING;
-		if (ioctl(uffd, UFFDIO_REGISTER, &uffdio_register) == -1)
-			errExit("ioctl-UFFDIO_REGISTER");
+	if (trace && (rgn.granule != replay.granule ||
+		      rgn.len / rgn.granule != replay.pages)) {
+		fprintf(stderr, "The region is not the one traced: %lu granules "
+			"of %lu bytes\n", replay.pages, replay.granule);
+		exit(EXIT_FAILURE);
+	}
 
-		printf("Memory Registered\n");
-	}	
+	/* [M7: point 1]
+	 * Create the pool of threads that will process userfaultfd events.
+	 * Page directories are spread over all nodes.
+	 */
+	if (profile)
+		prof_init(self, rgn.len / granule, granule);
+	if (record)
+		trace_record_start(self, rgn.len / granule, granule);
+	msi_init(self, nnodes, &rgn, transport);
+	for (int i = 0; i < nnodes; i++)
+		if (i != self)
+			msi_add_peer(i, peer[i]);
+	if (faultlog)
+		flog_open(faultlog, self, &rgn, nhandlers);
+	fault_start(&rgn, nhandlers, prefetch_window);
+	if (stats)
+		lat_export(stats, LAT_EXPORT_MS);
+	if (trace)
+		replay_trace(rgn.base, self);
+	else
+		command_loop(rgn.base, rgn.len);
+
+	/* Wait for the other nodes to be done too, so that none of them
+	 * takes our leaving for a failure before writing its own output.
+	 */
+	dsm_barrier();
+	msi_shutdown();
+	if (profile)
+		write_profile();
+	if (record)
+		write_record();
 
 	exit(EXIT_SUCCESS);
 }